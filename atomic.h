@@ -0,0 +1,24 @@
+/* 
+ * File:   atomic.h
+ *
+ *  Lock-free primitives on 32-bit words. They compile to single
+ *  locked instructions, so they are safe against interrupts and
+ *  never need a system call.
+ */
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#include "common.h"
+
+/* Add val to *ptr and return the new value */
+static inline int32_t atomic_add(volatile int32_t * ptr, int32_t val) {
+    return __sync_add_and_fetch(ptr, val);
+}
+
+/* Store new into *ptr if it still holds old. Returns true on success */
+static inline bool atomic_cmpxchg(volatile int32_t * ptr, int32_t old, int32_t new) {
+    return __sync_bool_compare_and_swap(ptr, old, new);
+}
+
+#endif /* ATOMIC_H */
@@ -0,0 +1,293 @@
+/* bench.c - Krypton boot time benchmarks
+ *
+ * Every benchmark times each iteration with the TSC and reports the
+ * minimum, average and maximum in cycles, plus the average in ns:
+ *
+ *   BENCH <name> n=<iterations> min=<c> avg=<c> max=<c> avg_ns=<ns>
+ *
+ * The suite ends with "BENCH done", or "BENCH skipped" without a TSC.
+ */
+
+#include "bench.h"
+#include "cpu.h"
+#include "task.h"
+#include "queue.h"
+#include "kmalloc.h"
+#include "kprintf.h"
+#include "timer.h"
+#include "serial.h"
+#include "syscalls.h"
+#include "mm.h"
+#include "trace.h"
+#include "profile.h"
+#include "irqstat.h"
+#include "memstat.h"
+
+#define BENCH_ITERATIONS    10000
+#define BENCH_TICKS         100
+#define BENCH_HEAP_SLOTS    64
+/* Scratch page for the map/unmap benchmark, in the private user area */
+#define BENCH_MAP_ADDR      0x7F000000
+
+extern list_head_t tasks_wait;
+extern task_t * running_task;
+
+struct bench_stat_s {
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t count;
+};
+
+typedef struct bench_stat_s bench_stat_t;
+
+static uint32_t tsc_khz;
+/* Shared with the partner tasks; kernel data is the same in every
+   address space */
+static volatile uint32_t partner_runs;
+static queue_t * volatile ping_queue;
+static queue_t * volatile pong_queue;
+
+static void stat_reset(bench_stat_t * stat) {
+    stat->min = 0xFFFFFFFF;
+    stat->max = 0;
+    stat->total = 0;
+    stat->count = 0;
+}
+
+static void stat_add(bench_stat_t * stat, uint64_t cycles) {
+    uint32_t c = (cycles > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) cycles;
+
+    if(c < stat->min)
+        stat->min = c;
+    if(c > stat->max)
+        stat->max = c;
+    stat->total += c;
+    stat->count++;
+}
+
+/* Bench output goes to COM1 for boot_bench.sh, and to the screen */
+static void bench_print(const char * line) {
+    serial_write(line);
+    kprintf("%s", line);
+}
+
+static void stat_report(const char * name, bench_stat_t * stat) {
+    char line[160];
+    uint32_t avg = 0, avg_ns = 0;
+
+    if(stat->count > 0) {
+        avg = (uint32_t) (stat->total / stat->count);
+        avg_ns = (uint32_t) ((uint64_t) avg * 1000000 / tsc_khz);
+    }
+    sprintf(line, "BENCH %s n=%u min=%u avg=%u max=%u avg_ns=%u\n",
+            name, stat->count, stat->count ? stat->min : 0, avg, stat->max, avg_ns);
+    bench_print(line);
+}
+
+/* Count TSC cycles over BENCH_TICKS / 10 timer ticks */
+static void bench_calibrate() {
+    uint32_t ticks = BENCH_TICKS / 10;
+    uint32_t start = system_tick;
+    uint64_t t0;
+
+    while(system_tick == start);
+    t0 = rdtsc();
+    start = system_tick;
+    while(system_tick - start < ticks);
+    tsc_khz = (uint32_t) ((rdtsc() - t0) * timer_frequency / ticks / 1000);
+}
+
+/* Sleep for good once a partner is done */
+static void partner_exit() {
+    while(1)
+        wait(TB_RESUME, &tasks_wait);
+}
+
+static void bench_syscall() {
+    bench_stat_t stat;
+    uint64_t t0;
+    uint32_t i;
+
+    stat_reset(&stat);
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        t0 = rdtsc();
+        system_call(SYSCALL_NOP, NULL);
+        stat_add(&stat, rdtsc() - t0);
+    }
+    stat_report("syscall_nop", &stat);
+}
+
+static void * yield_partner(void * arg) {
+    (void) arg;
+    while(partner_runs)
+        yield();
+    partner_exit();
+    return NULL;
+}
+
+/* One iteration is two switches: to the partner and back */
+static void bench_yield() {
+    bench_stat_t stat;
+    uint64_t t0;
+    uint32_t i;
+
+    partner_runs = 1;
+    if(create_task(yield_partner, "org.era.bench.yield", BENCH_PRI, 0x2000) == NULL)
+        return;
+    yield();
+
+    stat_reset(&stat);
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        t0 = rdtsc();
+        yield();
+        stat_add(&stat, rdtsc() - t0);
+    }
+    partner_runs = 0;
+    yield();
+    stat_report("yield_pingpong", &stat);
+}
+
+static void * queue_partner(void * arg) {
+    uint32_t value;
+
+    (void) arg;
+    /* Queues signal their creator, so the partner makes its own */
+    ping_queue = create_queue(1, sizeof(uint32_t));
+    while(ping_queue != NULL) {
+        queue_recv(ping_queue, (char *) &value, QM_BLOCKING);
+        queue_send(pong_queue, (char *) &value, QM_NONBLOCKING);
+    }
+    partner_exit();
+    return NULL;
+}
+
+/* One iteration is a message to the partner and its answer */
+static void bench_queue() {
+    bench_stat_t stat;
+    uint64_t t0;
+    uint32_t i, value;
+
+    ping_queue = NULL;
+    if((pong_queue = create_queue(1, sizeof(uint32_t))) == NULL)
+        return;
+    if(create_task(queue_partner, "org.era.bench.queue", BENCH_PRI, 0x2000) == NULL)
+        return;
+    while(ping_queue == NULL)
+        yield();
+
+    stat_reset(&stat);
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        t0 = rdtsc();
+        queue_send(ping_queue, (char *) &i, QM_NONBLOCKING);
+        queue_recv(pong_queue, (char *) &value, QM_BLOCKING);
+        stat_add(&stat, rdtsc() - t0);
+    }
+    stat_report("queue_pingpong", &stat);
+}
+
+/* kmalloc() + kfree() pairs, replacing random blocks of a live set */
+static void bench_kmalloc() {
+    static void * slots[BENCH_HEAP_SLOTS];
+    bench_stat_t stat;
+    uint32_t i, slot, size, seed = 1;
+    uint64_t t0;
+
+    for(i = 0; i < BENCH_HEAP_SLOTS; i++)
+        slots[i] = kmalloc(16 + (i * 37) % 512);
+
+    stat_reset(&stat);
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        seed = seed * 1103515245 + 12345;
+        slot = (seed >> 16) % BENCH_HEAP_SLOTS;
+        size = (seed & 0x8000) ? 16 + (seed >> 8) % 112 : 128 + (seed >> 4) % 2048;
+        t0 = rdtsc();
+        kfree(slots[slot]);
+        slots[slot] = kmalloc(size);
+        stat_add(&stat, rdtsc() - t0);
+    }
+    for(i = 0; i < BENCH_HEAP_SLOTS; i++)
+        kfree(slots[i]);
+    stat_report("kmalloc_churn", &stat);
+}
+
+/* Map a frame, touch it, unmap it */
+static void bench_map() {
+    bench_stat_t stat;
+    uint32_t i, frame;
+    uint64_t t0;
+
+    if((frame = pa_alloc()) == 0)
+        return;
+
+    stat_reset(&stat);
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        t0 = rdtsc();
+        dos_mm_map((void *) frame, (void *) BENCH_MAP_ADDR, PAGE_WRITE | PAGE_USER);
+        *(volatile uint32_t *) BENCH_MAP_ADDR = i;
+        dos_mm_unmap((void *) BENCH_MAP_ADDR);
+        stat_add(&stat, rdtsc() - t0);
+    }
+    pa_free(frame);
+    stat_report("page_map_unmap", &stat);
+}
+
+/* Time from the timer interrupt to the delayed task running, and how
+   far each wakeup period is from the nominal tick */
+static void bench_timer() {
+    bench_stat_t latency, jitter;
+    uint64_t now, last = 0;
+    uint32_t period = tsc_khz * 1000 / timer_frequency;
+    uint32_t i, elapsed;
+
+    stat_reset(&latency);
+    stat_reset(&jitter);
+    delay(1);
+    for(i = 0; i < BENCH_TICKS; i++) {
+        delay(1);
+        now = rdtsc();
+        stat_add(&latency, now - system_tick_tsc);
+        if(last != 0) {
+            elapsed = (uint32_t) (now - last);
+            stat_add(&jitter, elapsed > period ? elapsed - period : period - elapsed);
+        }
+        last = now;
+    }
+    stat_report("timer_wakeup_latency", &latency);
+    stat_report("timer_period_jitter", &jitter);
+}
+
+void * bench_task(void * arg) {
+    char line[64];
+
+    (void) arg;
+    init_serial();
+    if(!(cpu_features_edx & CPU_FEAT_TSC)) {
+        serial_write("BENCH skipped\n");
+    }
+    else {
+        bench_calibrate();
+        profile_reset();
+        sprintf(line, "BENCH tsc_khz=%u\n", tsc_khz);
+        bench_print(line);
+
+        bench_syscall();
+        bench_yield();
+        bench_queue();
+        bench_kmalloc();
+        bench_map();
+        bench_timer();
+        serial_write("BENCH done\n");
+        irq_stats_dump();
+        trace_dump();
+        profile_dump();
+    }
+    mem_stats_report(bench_print);
+
+    /* Power off under QEMU, just stop anywhere else */
+    outb(BENCH_EXIT_PORT, 0);
+    kprintf("Benchmarks done.\n");
+    while(1)
+        wait(TB_RESUME, &tasks_wait);
+    return NULL;
+}
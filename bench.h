@@ -0,0 +1,23 @@
+/*
+ * File:   bench.h
+ *
+ *  Boot time benchmark suite, run instead of the shell when the kernel
+ *  command line holds "bench". Results go to the serial port, one
+ *  "BENCH" line per benchmark, then QEMU is told to exit.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "common.h"
+
+/* Priority of the benchmark tasks, above every system task */
+#define BENCH_PRI           20
+
+/* QEMU isa-debug-exit device, exits with (value << 1) | 1 */
+#define BENCH_EXIT_PORT     0xF4
+
+/* Task entry point of the suite */
+void * bench_task(void * arg);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * File:   bench.h
+ *
+ *  Hosted microbenchmarks. The kernel modules are built unchanged as a
+ *  static i686 Linux program; shim.c stands in for the hardware and
+ *  scheduler bits they call into.
+ */
+
+#ifndef HOST_BENCH_H
+#define HOST_BENCH_H
+
+#include "../common.h"
+#include "../kprintf.h"
+
+/* Timing, in nanoseconds of CLOCK_MONOTONIC */
+uint64_t bench_now();
+
+/* Print "name: ops, ns/op" for a finished run */
+void bench_report(const char * name, uint32_t ops, uint64_t start, uint64_t end);
+
+/* Deterministic xorshift generator, so runs are comparable */
+uint32_t bench_rand();
+
+void bench_seed(uint32_t seed);
+
+/* 64 by 32 bit division without libgcc */
+uint64_t bench_div(uint64_t n, uint32_t d);
+
+void bench_list();
+
+void bench_heap();
+
+void bench_pages();
+
+/* Kernel pieces the benchmarks poke at directly */
+extern list_head_t k_heap_start;
+extern uint32_t k_heap_end;
+extern uint32_t LowRamFreeCount;
+extern list_head_t mem_handlers;
+
+/* Pages mm_map()/mm_unmap_range() were asked to map and unmap */
+extern uint32_t shim_pages_mapped;
+extern uint32_t shim_pages_unmapped;
+
+#endif
@@ -0,0 +1,131 @@
+/* bench_heap.c - kernel heap benchmarks
+ *
+ * The size mix follows what the kernel actually allocates: mostly
+ * small nodes and messages, some task structures and a few I/O sized
+ * buffers.
+ */
+
+#include "bench.h"
+#include "../kmalloc.h"
+
+#define HEAP_SLOTS      512
+#define HEAP_OPS        100000
+
+static void * slots[HEAP_SLOTS];
+static uint32_t sizes[HEAP_SLOTS];
+
+static uint32_t mixed_size() {
+    uint32_t r = bench_rand() % 100;
+
+    if(r < 60)
+        return 16 + bench_rand() % 48;          // nodes, messages, regions
+    if(r < 85)
+        return 64 + bench_rand() % 448;         // ports, queues, tasks
+    if(r < 95)
+        return 512 + bench_rand() % 3584;       // line and sector buffers
+    return 4096 + bench_rand() % 12288;         // I/O buffers
+}
+
+/* Free bytes, largest free chunk and heap size, from the chunk list */
+static void heap_report() {
+    chunk_t * chunk = (chunk_t *) get_head(&k_heap_start);
+    uint32_t free_sz = 0, largest = 0, chunks = 0;
+    uint32_t heap_sz = k_heap_end - HEAP_ADDR;
+
+    while(chunk) {
+        free_sz += chunk->size;
+        if(chunk->size > largest)
+            largest = chunk->size;
+        chunks++;
+        chunk = (chunk_t *) get_next((list_node_t *) chunk);
+    }
+    kprintf("  heap %u kB, %u bytes free in %u chunks, largest %u",
+            heap_sz / 1024, free_sz, chunks, largest);
+    if(free_sz)
+        kprintf(", fragmentation %u%%", 100 - (uint32_t) bench_div((uint64_t) largest * 100, free_sz));
+    kprintf("\n  pages mapped %u, unmapped %u\n", shim_pages_mapped, shim_pages_unmapped);
+}
+
+static void free_all() {
+    uint32_t i;
+
+    for(i = 0; i < HEAP_SLOTS; i++) {
+        if(slots[i] != NULL)
+            _kfree(slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+/* Allocate and free the same size over and over */
+static void bench_fixed(uint32_t size) {
+    uint64_t start, end;
+    char name[48];
+    uint32_t i;
+    void * ptr;
+
+    start = bench_now();
+    for(i = 0; i < HEAP_OPS; i++) {
+        ptr = _kmalloc(size);
+        _kfree(ptr);
+    }
+    end = bench_now();
+
+    sprintf(name, "_kmalloc + _kfree, %u bytes", size);
+    bench_report(name, HEAP_OPS, start, end);
+}
+
+/* Fill the slots, then free them in allocation or reverse order */
+static void bench_batch(uint32_t reverse) {
+    uint64_t start, end;
+    uint32_t i;
+
+    bench_seed(2);
+    start = bench_now();
+    for(i = 0; i < HEAP_SLOTS; i++)
+        slots[i] = _kmalloc(mixed_size());
+    for(i = 0; i < HEAP_SLOTS; i++) {
+        _kfree(slots[reverse ? HEAP_SLOTS - 1 - i : i]);
+        slots[reverse ? HEAP_SLOTS - 1 - i : i] = NULL;
+    }
+    end = bench_now();
+
+    bench_report(reverse ? "mixed batch, freed LIFO" : "mixed batch, freed FIFO",
+                 HEAP_SLOTS * 2, start, end);
+}
+
+/* Steady state: a random live set where each op replaces one block */
+static void bench_churn() {
+    uint64_t start, end;
+    uint32_t i, slot;
+
+    bench_seed(3);
+    for(i = 0; i < HEAP_SLOTS; i++) {
+        sizes[i] = mixed_size();
+        slots[i] = _kmalloc(sizes[i]);
+    }
+
+    start = bench_now();
+    for(i = 0; i < HEAP_OPS; i++) {
+        slot = bench_rand() % HEAP_SLOTS;
+        _kfree(slots[slot]);
+        sizes[slot] = mixed_size();
+        slots[slot] = _kmalloc(sizes[slot]);
+    }
+    end = bench_now();
+
+    bench_report("mixed churn, 512 live blocks", HEAP_OPS, start, end);
+    heap_report();
+    free_all();
+}
+
+void bench_heap() {
+    kprintf("\nKernel heap\n");
+    bench_fixed(32);
+    bench_fixed(256);
+    bench_fixed(4096);
+    bench_batch(0);
+    bench_batch(1);
+    bench_churn();
+    kprintf("  after freeing everything:\n");
+    heap_report();
+}
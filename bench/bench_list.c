@@ -0,0 +1,63 @@
+/* bench_list.c - list and message queue benchmarks */
+
+#include "bench.h"
+#include "../queue.h"
+
+#define LIST_MAX_NODES  1024
+#define LIST_OPS        200000
+#define QUEUE_OPS       100000
+
+static list_node_t nodes[LIST_MAX_NODES];
+
+/* enqueue() into a priority list holding about depth nodes, the way
+   the ready list and mutex waiter lists are used */
+static void bench_enqueue(uint32_t depth) {
+    list_head_t list;
+    list_node_t * node;
+    uint64_t start, end;
+    char name[48];
+    uint32_t i;
+
+    new_list(&list);
+    for(i = 0; i < depth; i++) {
+        nodes[i].pri = (int32_t) (bench_rand() % 64) - 32;
+        enqueue(&list, &nodes[i]);
+    }
+
+    start = bench_now();
+    for(i = 0; i < LIST_OPS; i++) {
+        node = remove_head(&list);
+        node->pri = (int32_t) (bench_rand() % 64) - 32;
+        enqueue(&list, node);
+    }
+    end = bench_now();
+
+    sprintf(name, "enqueue, %u nodes deep", depth);
+    bench_report(name, LIST_OPS, start, end);
+}
+
+static void bench_queue() {
+    queue_t * queue = create_queue(16, sizeof(uint32_t));
+    uint64_t start, end;
+    uint32_t i, value = 0;
+
+    start = bench_now();
+    for(i = 0; i < QUEUE_OPS; i++) {
+        queue_send(queue, (char *) &i, QM_NONBLOCKING);
+        queue_recv(queue, (char *) &value, QM_NONBLOCKING);
+    }
+    end = bench_now();
+
+    bench_report("queue_send + queue_recv", QUEUE_OPS, start, end);
+    destroy_queue(queue);
+}
+
+void bench_list() {
+    kprintf("\nLists\n");
+    bench_seed(1);
+    bench_enqueue(4);
+    bench_enqueue(32);
+    bench_enqueue(256);
+    bench_enqueue(LIST_MAX_NODES);
+    bench_queue();
+}
@@ -0,0 +1,76 @@
+/* bench_pages.c - physical page allocator benchmarks */
+
+#include "bench.h"
+#include "../mm.h"
+
+#define PAGE_BATCH      1024
+#define PAGE_OPS        100000
+
+static uint32_t frames[PAGE_BATCH];
+
+/* Alloc a batch of frames, then give them all back */
+static void bench_batch() {
+    uint64_t start, end;
+    uint32_t i;
+
+    start = bench_now();
+    for(i = 0; i < PAGE_BATCH; i++)
+        frames[i] = pa_alloc();
+    for(i = 0; i < PAGE_BATCH; i++)
+        pa_free(frames[i]);
+    end = bench_now();
+
+    bench_report("pa_alloc + pa_free, batch of 1024", PAGE_BATCH * 2, start, end);
+}
+
+/* Keep a batch allocated and free/realloc random frames, so the free
+   bits end up scattered through the bitmap */
+static void bench_scattered() {
+    uint64_t start, end;
+    uint32_t i, slot;
+
+    for(i = 0; i < PAGE_BATCH; i++)
+        frames[i] = pa_alloc();
+
+    bench_seed(4);
+    start = bench_now();
+    for(i = 0; i < PAGE_OPS; i++) {
+        slot = bench_rand() % PAGE_BATCH;
+        pa_free(frames[slot]);
+        frames[slot] = pa_alloc();
+    }
+    end = bench_now();
+
+    bench_report("pa_free + pa_alloc, scattered", PAGE_OPS, start, end);
+    for(i = 0; i < PAGE_BATCH; i++)
+        pa_free(frames[i]);
+}
+
+/* Contiguous runs, as DMA buffers would take them */
+static void bench_contig(uint32_t pages) {
+    uint64_t start, end;
+    uint32_t i, j, paddr;
+    char name[48];
+
+    start = bench_now();
+    for(i = 0; i < PAGE_OPS / 10; i++) {
+        paddr = pa_alloc_contig(pages, PAGE_SIZE, 0x1000000);
+        for(j = 0; j < pages; j++)
+            pa_free(paddr + j * PAGE_SIZE);
+    }
+    end = bench_now();
+
+    sprintf(name, "pa_alloc_contig, %u pages", pages);
+    bench_report(name, PAGE_OPS / 10, start, end);
+}
+
+void bench_pages() {
+    uint32_t free_before = LowRamFreeCount;
+
+    kprintf("\nPhysical pages\n");
+    bench_batch();
+    bench_scattered();
+    bench_contig(4);
+    bench_contig(16);
+    kprintf("  %u free frames before, %u after\n", free_before, LowRamFreeCount);
+}
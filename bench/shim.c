@@ -0,0 +1,226 @@
+/* shim.c - Host shim for the benchmark build
+ *
+ * Provides a process entry point, a few raw Linux system calls and
+ * the kernel symbols that only make sense on the real machine. The
+ * heap address range is reserved with a fixed mmap(), so the heap
+ * code runs at the same addresses as in the kernel.
+ */
+
+#include "bench.h"
+#include "../kmalloc.h"
+#include "../syscalls.h"
+#include "../task.h"
+#include "../mm.h"
+
+#define SYS_EXIT_GROUP      252
+#define SYS_WRITE           4
+#define SYS_MMAP2           192
+#define SYS_CLOCK_GETTIME   265
+
+#define CLOCK_MONOTONIC     1
+#define PROT_READ           1
+#define PROT_WRITE          2
+#define MAP_PRIVATE         0x02
+#define MAP_FIXED           0x10
+#define MAP_ANONYMOUS       0x20
+#define MAP_NORESERVE       0x4000
+
+/* Virtual space the heap may grow into */
+#define SHIM_HEAP_SIZE      0x4000000
+
+task_t * running_task;
+list_head_t tasks_wait;
+uint32_t cpu_features_edx;
+uint32_t cpu_features_ecx;
+uint32_t shim_pages_mapped;
+uint32_t shim_pages_unmapped;
+
+static task_t shim_task;
+static uint32_t shim_frames[SHIM_HEAP_SIZE / PAGE_SIZE];
+
+static int32_t linux_call(uint32_t nr, uint32_t a, uint32_t b, uint32_t c,
+                          uint32_t d, uint32_t e, uint32_t f) {
+    int32_t ret;
+
+    /* ebp can't be named as an operand, so swap it in by hand */
+    asm volatile("push %%ebp\n"
+                 "mov %7, %%ebp\n"
+                 "int $0x80\n"
+                 "pop %%ebp\n"
+                 : "=a" (ret)
+                 : "a" (nr), "b" (a), "c" (b), "d" (c), "S" (d), "D" (e), "m" (f)
+                 : "memory");
+    return ret;
+}
+
+static void shim_exit(int code) {
+    linux_call(SYS_EXIT_GROUP, code, 0, 0, 0, 0, 0);
+    for(;;);
+}
+
+/***************************************
+ * Kernel services
+ ***************************************/
+
+void monitor_write(char * c) {
+    linux_call(SYS_WRITE, 1, (uint32_t) c, strlen(c), 0, 0, 0);
+}
+
+void panic(const char * message) {
+    kprintf("PANIC: %s\n", message);
+    shim_exit(1);
+}
+
+/* Only reached from the emergency log path */
+void serial_write(const char * str) {
+    (void) str;
+}
+
+void delay(uint32_t ticks) {
+    (void) ticks;
+    panic("benchmark would block");
+}
+
+/* No privilege change here, just call the handler */
+void system_call(int call, void * arg) {
+    switch(call) {
+        case SYSCALL_KMALLOC: *(uint32_t *) arg = (uint32_t) _kmalloc(*(uint32_t *) arg); break;
+        case SYSCALL_KFREE: _kfree(arg); break;
+        default: panic("unsupported system call");
+    }
+}
+
+void enable() {
+}
+
+void disable() {
+}
+
+void forbid() {
+}
+
+void permit() {
+}
+
+uint32_t signal(task_t * task, uint32_t sigs) {
+    (void) task;
+    return sigs;
+}
+
+uint32_t wait(uint32_t sigs, list_head_t * list) {
+    (void) sigs;
+    (void) list;
+    panic("benchmark would block");
+    return 0;
+}
+
+/* The heap range is mapped once at startup, so only remember which
+   frame backs each heap page, for mm_unmap_range() to free it */
+void * mm_map(void * physaddr, void * virtualaddr, unsigned int flags) {
+    uint32_t va = (uint32_t) virtualaddr;
+
+    (void) flags;
+    if(physaddr == NULL || va < HEAP_ADDR || va >= HEAP_ADDR + SHIM_HEAP_SIZE)
+        return NULL;
+    shim_frames[(va - HEAP_ADDR) >> 12] = (uint32_t) physaddr;
+    shim_pages_mapped++;
+    return virtualaddr;
+}
+
+void mm_unmap_range(void * virtualaddr, uint32_t size, unsigned int flags) {
+    uint32_t va;
+
+    for(va = (uint32_t) virtualaddr; va < (uint32_t) virtualaddr + size; va += PAGE_SIZE) {
+        if(flags & MM_UNMAP_FREE)
+            pa_unref(shim_frames[(va - HEAP_ADDR) >> 12]);
+        shim_frames[(va - HEAP_ADDR) >> 12] = 0;
+        shim_pages_unmapped++;
+    }
+}
+
+/* mm.c needs these to link, they are never called here */
+void gdt_install() {
+}
+
+void init_idt() {
+}
+
+void register_interrupt_handler(uint8_t n, interrupt_handler_t handler) {
+    (void) n;
+    (void) handler;
+}
+
+void cpu_detect() {
+}
+
+/***************************************
+ * Benchmark support
+ ***************************************/
+
+uint64_t bench_div(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t) (n >> 32), lo = (uint32_t) n;
+    uint32_t q_hi = hi / d, rem = hi % d, q_lo;
+
+    asm("divl %4" : "=a" (q_lo), "=d" (rem) : "a" (lo), "d" (rem), "r" (d));
+    return ((uint64_t) q_hi << 32) | q_lo;
+}
+
+uint64_t bench_now() {
+    struct { int32_t tv_sec; int32_t tv_nsec; } ts;
+
+    linux_call(SYS_CLOCK_GETTIME, CLOCK_MONOTONIC, (uint32_t) &ts, 0, 0, 0, 0);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_report(const char * name, uint32_t ops, uint64_t start, uint64_t end) {
+    uint32_t tenths = (uint32_t) bench_div((end - start) * 10, ops);
+
+    kprintf("  %-36s %9u ops %7u.%u ns/op\n", name, ops, tenths / 10, tenths % 10);
+}
+
+static uint32_t rand_state = 2463534242u;
+
+void bench_seed(uint32_t seed) {
+    rand_state = seed ? seed : 2463534242u;
+}
+
+uint32_t bench_rand() {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void bench_main() {
+    int32_t heap;
+    uint32_t paddr;
+
+    /* The heap runs at its kernel address */
+    heap = linux_call(SYS_MMAP2, HEAP_ADDR, SHIM_HEAP_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(heap != HEAP_ADDR)
+        panic("can't reserve the heap address range");
+
+    /* What mm_init() does, minus the hardware: all RAM from 1 MiB to
+       15 MiB is free */
+    strcpy(shim_task.ln_link.name, "bench");
+    running_task = &shim_task;
+    new_list(&tasks_wait);
+    new_list(&mem_handlers);
+    for(paddr = 0x100000; paddr < 0xF00000; paddr += PAGE_SIZE)
+        pa_free(paddr);
+    kheap_init();
+
+    kprintf("Krypton host benchmarks, %u free frames\n", LowRamFreeCount);
+    bench_list();
+    bench_heap();
+    bench_pages();
+    shim_exit(0);
+}
+
+/* Process entry point: the stack is already set up by Linux, just
+   keep it aligned for the compiler */
+void __attribute__((noreturn, force_align_arg_pointer)) _start() {
+    bench_main();
+    for(;;);
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Headless benchmark run: boots the benchmark entry, prints the BENCH
+# lines from the serial port and exits 0 if the suite completed.
+# The ISO and bench.log go to $BENCH_OUT, a fresh temporary directory
+# by default, so the tree stays clean.
+set -e
+out=${BENCH_OUT:-$(mktemp -d "${TMPDIR:-/tmp}/krypton-bench.XXXXXX")}
+mkdir -p "$out/iso/boot/grub"
+cp kry_kern "$out/iso/boot/kry_kern"
+cat > "$out/iso/boot/grub/grub.cfg" <<CFG
+set timeout=0
+set default=0
+
+menuentry "Krypton (benchmarks)" {
+   multiboot /boot/kry_kern bench
+   boot
+}
+CFG
+grub-mkrescue -o "$out/krypton-bench.iso" "$out/iso" 2>/dev/null
+set +e
+timeout ${BENCH_TIMEOUT:-120} qemu-system-i386 -cdrom "$out/krypton-bench.iso" -m 256 \
+    -display none -serial stdio -monitor none \
+    -device isa-debug-exit,iobase=0xf4,iosize=0x04 | tr -d '\r' | tee "$out/bench.log"
+# isa-debug-exit makes QEMU exit with (0 << 1) | 1
+status=${PIPESTATUS[0]}
+echo "serial log: $out/bench.log"
+[ "$status" = 1 ] && grep -q "^BENCH done" "$out/bench.log"
@@ -20,9 +20,14 @@ extern struct sys_base_t * sys_base;
 #define NT_TASK         5
 #define NT_INTERRUPT    6
 #define NT_SEMAPOHORE   7
+#define NT_MESSAGE      8
+#define NT_REPLYMSG     9
+#define NT_FREEMSG      10
 
 // Some standard typedefs, to standardise sizes across platforms.
 // These typedefs are written for 32-bit X86.
+typedef unsigned long long uint64_t;
+typedef          long long int64_t;
 typedef unsigned int   uint32_t;
 typedef          int   int32_t;
 typedef unsigned short uint16_t;
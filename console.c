@@ -2,8 +2,13 @@
 #include "idt.h"
 #include "queue.h"
 #include "device.h"
+#include "monitor.h"
+#include "cpu.h"
 
-extern list_node_t tasks_wait;
+#define CON_LINE_MAX    256
+
+extern list_head_t tasks_wait;
+extern task_t * running_task;
 static void keypress_isr(registers_t *regs);
 
 queue_t * keybd_queue;
@@ -81,48 +86,89 @@ static void keypress_isr(registers_t *regs) {
 void* console_device(void * arg) {
 
     uint32_t scancode;
-    iorq_t iorq;
-    int i;
+    iorq_t * iorq;
+    uint32_t i, max_len, len;
     char c;
-    char * aux;
+    char line[CON_LINE_MAX];
     
     memset(&keybd_device, 0, sizeof(device_t));
     strcpy(keybd_device.ln_link.name, "org.era.dev.console");
-    keybd_device.iorq_queue = create_queue(10, sizeof(iorq_t));
+    init_msgport(&keybd_device.iorq_port, running_task);
+    register_device_node(&keybd_device);
 
     keybd_queue = create_queue(1, sizeof(uint32_t));
     register_interrupt_handler(IRQ1, &keypress_isr);
     monitor_writexy(0,24, " 1", 7, 0);
     
     for(;;) {
-        queue_recv(keybd_device.iorq_queue, &iorq, QM_BLOCKING);
-        if(iorq.io_desc == DC_READ) {
+        wait_port(&keybd_device.iorq_port);
+        iorq = (iorq_t *) get_msg(&keybd_device.iorq_port);
+        switch(iorq->io_desc) {
+        case DC_READ:
+            /* The line is edited locally and scattered into the
+               request buffers once it is complete */
             i = 0;
-            aux = (char *) iorq.io_dptr;
-            memset(aux, 0, iorq.io_sz);
+            max_len = io_length(iorq);
+            if(max_len == 0) {
+                iorq->io_error = IOERR_BADLENGTH;
+                break;
+            }
+            if(max_len > CON_LINE_MAX)
+                max_len = CON_LINE_MAX;
             
             while(1) {
-                queue_recv(keybd_queue, &scancode, QM_BLOCKING);
+                /* Look at the abort flag before sleeping for each key.
+                   Interrupts stay off until wait() has us on the list,
+                   so neither the ISR nor abort_io() can signal in
+                   between */
+                disable();
+                while(!(iorq->io_flags & IOF_ABORT) &&
+                      queue_recv(keybd_queue, (char *) &scancode, QM_NONBLOCKING) == NULL) {
+                    wait(TB_QUEUE | TB_ABORT, &tasks_wait);
+                    disable();
+                }
+                running_task->sigs_waiting &= ~(TB_QUEUE | TB_ABORT);
+                enable();
+                if (iorq->io_flags & IOF_ABORT) {
+                    iorq->io_error = IOERR_ABORTED;
+                    break;
+                }
                 c = kbdus[scancode];
                 if (c == '\n')
                     break;
                 if ((c == '\b') && (i > 0)) {
-                    aux[i] = '\0';
                     i--;
                     monitor_put('\b');
                     continue;
                 }
-                if (c == 0 || c == '\t' || i == (iorq.io_sz - 1))
+                if (c == 0 || c == '\t' || i == (max_len - 1))
                     continue;
                 if(isprintable(c) ) {
-                    aux[i++] = c;
+                    line[i++] = c;
                     monitor_put(c);
                 }
             }
             monitor_put('\n');
-            aux[i] = '\0';
-
-            queue_send(iorq.io_response, NULL, QM_NONBLOCKING);
+            /* An aborted line is dropped */
+            if (iorq->io_error == IOERR_ABORTED)
+                break;
+            line[i] = '\0';
+            io_scatter(iorq, 0, line, i + 1);
+            iorq->io_actual = i;
+            break;
+        case DC_WRITE:
+            /* Gather the request buffers a line buffer at a time */
+            max_len = io_length(iorq);
+            for(i = 0; i < max_len; i += len) {
+                len = io_gather(iorq, i, line, CON_LINE_MAX - 1);
+                line[len] = '\0';
+                monitor_write(line);
+            }
+            iorq->io_actual = max_len;
+            break;
+        default:
+            iorq->io_error = IOERR_NOCMD;
         }
+        reply_msg((message_t *) iorq);
     }
 }
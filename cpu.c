@@ -19,6 +19,10 @@ struct idt_ptr iptr;
 
 tss_entry_t tss_entry;
 
+// Standard CPUID feature flags (leaf 1)
+uint32_t cpu_features_edx;
+uint32_t cpu_features_ecx;
+
 // Extern assembler function
 extern void gdt_flush();
 extern void idt_load();
@@ -26,6 +30,13 @@ extern void tss_flush();
 
 extern unsigned int user_stack_top;
 
+void cpu_detect(){
+    uint32_t eax, ebx;
+    asm volatile ("cpuid"
+                  : "=a" (eax), "=b" (ebx), "=c" (cpu_features_ecx), "=d" (cpu_features_edx)
+                  : "a" (1));
+}
+
 void enable(){
     asm volatile ("sti");
 }
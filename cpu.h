@@ -100,8 +100,57 @@ void enable();
 
 void disable();
 
+/* Disable interrupts and return the previous EFLAGS, for code that may
+   run with interrupts already off. Tasks can use them too, IOPL is 3 */
+static inline uint32_t intr_save() {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r" (flags) :: "memory");
+    return flags;
+}
+
+static inline void intr_restore(uint32_t flags) {
+    asm volatile("push %0; popf" :: "r" (flags) : "memory", "cc");
+}
+
 void set_kernel_stack(uint32_t stack);
 
+/*******************************************************************
+ cpu_detect(), cpu_has()
+ CPUID feature detection. cpu_detect() runs once, before paging is
+ set up, and caches the standard feature flags
+ *******************************************************************/
+#define CPU_FEAT_PSE        (1 << 3)    // 4 MiB pages
+#define CPU_FEAT_TSC        (1 << 4)    // Time stamp counter
+#define CPU_FEAT_PAE        (1 << 6)    // Physical address extension
+#define CPU_FEAT_PGE        (1 << 13)   // Global pages
+#define CPU_FEAT_SSE2       (1 << 26)   // SSE2 (movnti)
+#define CPU_FEAT_PCID       (1 << 17)   // Process context ids (ECX)
+
+#define CR4_PSE             (1 << 4)
+#define CR4_PGE             (1 << 7)
+
+extern uint32_t cpu_features_edx;
+extern uint32_t cpu_features_ecx;
+
+void cpu_detect();
+
+static inline uint32_t read_cr4() {
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    asm volatile("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+/* Time stamp counter, usable from tasks as CR4.TSD is left clear */
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
 void idt_install();
 
 #endif
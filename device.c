@@ -1,47 +1,238 @@
 #include "device.h"
+#include "semaphore.h"
+
+extern list_head_t tasks_wait;
+extern task_t * running_task;
+
+#define DEV_HASH_BUCKETS    32
 
 list_head_t device_list;
 
+/* Serializes registry updates and lookups */
+static mutex_t device_lock;
+
+/* Device name index, chained through dev_hash_next */
+static device_t * device_hash[DEV_HASH_BUCKETS];
+
+static uint32_t io_copy(iorq_t * req, uint32_t offset, uint8_t * buf, uint32_t len, int to_req);
+
+/* FNV-1a hash of a device name */
+static uint32_t hash_name(char * name) {
+    uint32_t hash = 2166136261U;
+    
+    while(*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+void init_device_list() {
+    new_list(&device_list);
+    init_mutex(&device_lock);
+}
+
 void register_device_node(device_t * dev) {
-    forbid();
+    uint32_t bucket;
+    
+    dev->dev_hash = hash_name(dev->ln_link.name);
+    dev->dev_open_count = 0;
+    bucket = dev->dev_hash % DEV_HASH_BUCKETS;
+    
+    obtain_mutex(&device_lock);
     add_head(&device_list, dev);
-    permit();
+    dev->dev_hash_next = device_hash[bucket];
+    device_hash[bucket] = dev;
+    release_mutex(&device_lock);
+}
+
+uint32_t remove_device_node(device_t * dev) {
+    device_t ** link;
+    
+    obtain_mutex(&device_lock);
+    if(dev->dev_open_count > 0) {
+        release_mutex(&device_lock);
+        return 0;
+    }
+    link = &device_hash[dev->dev_hash % DEV_HASH_BUCKETS];
+    while(*link && *link != dev)
+        link = &(*link)->dev_hash_next;
+    if(*link)
+        *link = dev->dev_hash_next;
+    remove((list_node_t *) dev);
+    release_mutex(&device_lock);
+    return 1;
 }
 
 device_t * get_device(char * dev_name) {
     device_t * aux;
+    uint32_t hash = hash_name(dev_name);
     
-    forbid();
-    aux = get_head(&device_list);
+    obtain_mutex(&device_lock);
+    aux = device_hash[hash % DEV_HASH_BUCKETS];
     while(aux) {
-        if(strcmp(dev_name, aux->ln_link.name) == 0)
+        if(aux->dev_hash == hash && strcmp(dev_name, aux->ln_link.name) == 0)
             break;
         else
-            aux = get_next(aux);
+            aux = aux->dev_hash_next;
     }
-    permit();
+    release_mutex(&device_lock);
     
     return aux;
 }
 
-iorq_t * do_io(device_t * dev, iorq_t * req) {
-    queue_t * recv_queue;
+device_t * open_device(char * dev_name) {
+    device_t * dev;
     
-    recv_queue = create_queue(1, sizeof(iorq_t));
+    obtain_mutex(&device_lock);
+    if((dev = get_device(dev_name)) != NULL)
+        dev->dev_open_count++;
+    release_mutex(&device_lock);
     
-    if(recv_queue == NULL) {
+    return dev;
+}
+
+void close_device(device_t * dev) {
+    obtain_mutex(&device_lock);
+    if(dev->dev_open_count > 0)
+        dev->dev_open_count--;
+    release_mutex(&device_lock);
+}
+
+iorq_t * do_io(device_t * dev, iorq_t * req) {
+    /* The reply port lives in the task structure, so a synchronous
+       request costs no allocation at all */
+    req->io_message.mn_reply_port = &running_task->reply_port;
+    if(!send_io(dev, req))
+        return NULL;
+    if(wait_io(req) != IOERR_OK)
         return NULL;
-    }
-        
-    req->io_response = recv_queue;
-    queue_send(dev->iorq_queue, req, QM_BLOCKING);
-    queue_recv(recv_queue, NULL, QM_BLOCKING);
-    destroy_queue(recv_queue);
     return req;
 }
 
 uint32_t send_io(device_t * dev, iorq_t * req) {
-    if(req->io_response == NULL)
+    if(dev == NULL) {
+        req->io_error = IOERR_OPENFAIL;
+        return 0;
+    }
+    if(req->io_message.mn_reply_port == NULL)
+        req->io_message.mn_reply_port = &running_task->reply_port;
+    
+    req->io_device = dev;
+    req->io_flags &= ~IOF_ABORT;
+    req->io_error = IOERR_OK;
+    req->io_actual = 0;
+    put_msg(&dev->iorq_port, (message_t *) req);
+    return 1;
+}
+
+iorq_t * check_io(iorq_t * req) {
+    if(req->io_message.mn_type == NT_MESSAGE)
         return NULL;
-    return queue_send(dev->iorq_queue, req, QM_NONBLOCKING);   
+    return req;
+}
+
+int32_t wait_io(iorq_t * req) {
+    msgport_t * port = req->io_message.mn_reply_port;
+    
+    forbid();
+    /* Other requests may complete on the same port first, so keep
+       sleeping until this one has been replied */
+    while(req->io_message.mn_type == NT_MESSAGE) {
+        wait(port->mp_sig_bit, &tasks_wait);
+        forbid();
+    }
+    if(req->io_message.mn_type == NT_REPLYMSG) {
+        remove((list_node_t *) req);
+        req->io_message.mn_type = NT_FREEMSG;
+    }
+    permit();
+    
+    return req->io_error;
+}
+
+void abort_io(iorq_t * req) {
+    list_node_t * aux;
+    task_t * task;
+    
+    forbid();
+    if(req->io_message.mn_type != NT_MESSAGE) {
+        permit();
+        return;
+    }
+    /* If the driver did not pick the request yet, take it back
+       from the device port and complete it right here */
+    aux = get_head(&req->io_device->iorq_port.mp_msg_list);
+    while(aux && aux != (list_node_t *) req)
+        aux = get_next(aux);
+    
+    if(aux == NULL) {
+        /* The driver owns it, let it notice the flag, and wake it in
+           case it sleeps waiting for input */
+        req->io_flags |= IOF_ABORT;
+        task = req->io_device->iorq_port.mp_sig_task;
+        permit();
+        if(task != NULL)
+            signal(task, TB_ABORT);
+        return;
+    }
+    remove(aux);
+    req->io_error = IOERR_ABORTED;
+    permit();
+    reply_msg((message_t *) req);
+}
+
+uint32_t io_length(iorq_t * req) {
+    uint32_t i, len = 0;
+    
+    if(req->io_iovcnt == 0)
+        return req->io_sz;
+    for(i = 0; i < req->io_iovcnt; i++)
+        len += req->io_iov[i].iov_len;
+    return len;
+}
+
+uint32_t io_scatter(iorq_t * req, uint32_t offset, void * src, uint32_t len) {
+    return io_copy(req, offset, (uint8_t *) src, len, 1);
+}
+
+uint32_t io_gather(iorq_t * req, uint32_t offset, void * dst, uint32_t len) {
+    return io_copy(req, offset, (uint8_t *) dst, len, 0);
+}
+
+/* Walk the request segments, skipping the first offset bytes, and copy
+   up to len bytes between them and buf. Returns the bytes copied. */
+static uint32_t io_copy(iorq_t * req, uint32_t offset, uint8_t * buf, uint32_t len, int to_req) {
+    iovec_t single, * iov;
+    uint32_t count, chunk, done = 0;
+    
+    if(req->io_iovcnt == 0) {
+        /* A plain request is just a one segment vector */
+        single.iov_base = req->io_dptr;
+        single.iov_len = req->io_sz;
+        iov = &single;
+        count = 1;
+    }
+    else {
+        iov = req->io_iov;
+        count = req->io_iovcnt;
+    }
+    
+    for(; count != 0 && len != 0; count--, iov++) {
+        if(offset >= iov->iov_len) {
+            offset -= iov->iov_len;
+            continue;
+        }
+        chunk = iov->iov_len - offset;
+        if(chunk > len)
+            chunk = len;
+        if(to_req)
+            memcpy((uint8_t *) iov->iov_base + offset, buf + done, chunk);
+        else
+            memcpy(buf + done, (uint8_t *) iov->iov_base + offset, chunk);
+        done += chunk;
+        len -= chunk;
+        offset = 0;
+    }
+    return done;
 }
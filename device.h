@@ -2,7 +2,7 @@
 #define DEVICE_H
 
 #include "common.h"
-#include "queue.h"
+#include "msgport.h"
 #include "task.h"
 
 enum GEN_DEVICE_COMMANDS {
@@ -13,33 +13,96 @@ enum GEN_DEVICE_COMMANDS {
     DC_FLUSH
 };
 
+/* I/O request error codes */
+#define IOERR_OK            0
+#define IOERR_OPENFAIL      -1
+#define IOERR_ABORTED       -2
+#define IOERR_NOCMD         -3
+#define IOERR_BADLENGTH     -4
+#define IOERR_NOMEM         -5
+
+/* I/O request flags */
+#define IOF_ABORT           1   /* abort_io() was called while in progress */
+
+/* One segment of a vectored request */
+struct iovec_s {
+    void * iov_base;
+    uint32_t iov_len;
+};
+
+typedef struct iovec_s iovec_t;
+
 struct iorq_s {
-    queue_t * io_response;
-    uint32_t io_desc;
-    uint32_t io_sz;
+    message_t io_message;
+    struct device_s * io_device;    /* Device the request was sent to */
+    uint32_t io_desc;               /* Command */
+    uint32_t io_flags;
+    int32_t io_error;               /* Completion status, IOERR_xxx */
+    uint32_t io_sz;                 /* Requested length */
+    uint32_t io_actual;             /* Length actually transferred */
     void * io_dptr;
+    iovec_t * io_iov;               /* Segment list, overrides io_dptr/io_sz */
+    uint32_t io_iovcnt;             /* Number of segments, 0 if not vectored */
 };
 
 typedef struct iorq_s iorq_t;
 
 struct device_s {
     list_node_t ln_link;
-    queue_t * iorq_queue;
+    msgport_t iorq_port;
+    struct device_s * dev_hash_next;    /* Next device in the name bucket */
+    uint32_t dev_hash;                  /* Hash of ln_link.name */
+    uint32_t dev_open_count;            /* Handles held by clients */
 };
 
 typedef struct device_s device_t;
 
+/* Set up the devs list and its name index */
+void init_device_list();
+
 /* Register a device queue in the devs list */
 void register_device_node(device_t *);
 
+/* Remove a device from the devs list, fails while it is open */
+uint32_t remove_device_node(device_t *);
+
 /* Seatch the devices list for a device */
 device_t * get_device(char *);
 
-/* Do an syncronous I/O op on a device */
+/* Resolve a device name once and get a counted handle to it */
+device_t * open_device(char *);
+
+/* Drop a handle returned by open_device() */
+void close_device(device_t *);
+
+/* Do an syncronous I/O op on a device. Returns NULL if there is no
+   device, or if the request failed (see io_error) */
 iorq_t * do_io(device_t *, iorq_t *);
 
-/* Do an asyncronous I/O op on a device */
+/* Do an asyncronous I/O op on a device. The request is replied to
+   io_message.mn_reply_port, or to the task reply port if none is set,
+   so several requests may share one port as a completion queue.
+   Returns 0 if there is no device to send to */
 uint32_t send_io(device_t *, iorq_t *);
 
+/* Return the request if it has completed, NULL if still in flight */
+iorq_t * check_io(iorq_t *);
+
+/* Wait for a request to complete and unlink it from its reply port */
+int32_t wait_io(iorq_t *);
+
+/* Ask the device to give up on a request; wait_io() must still follow.
+   A driver sleeping on input should also wait for TB_ABORT */
+void abort_io(iorq_t *);
+
+/* Total length of the request buffers, vectored or not */
+uint32_t io_length(iorq_t *);
+
+/* Copy data into the request buffers starting at a logical offset */
+uint32_t io_scatter(iorq_t *, uint32_t offset, void * src, uint32_t len);
+
+/* Copy data out of the request buffers starting at a logical offset */
+uint32_t io_gather(iorq_t *, uint32_t offset, void * dst, uint32_t len);
+
 #endif
 
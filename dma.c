@@ -0,0 +1,84 @@
+/* dma.c - Krypton DMA buffer allocation
+ *
+ * DMA memory comes straight from the page allocator as a run of frames
+ * and is used through the direct map, so it costs no mappings.
+ */
+
+#include "dma.h"
+#include "mm.h"
+
+void * dma_alloc(uint32_t size, uint32_t align, uint32_t max_paddr, uint32_t * paddr) {
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t start;
+
+    /* Only what the direct map covers can be handed out */
+    if(max_paddr > PHYS_MAP_SIZE)
+        max_paddr = PHYS_MAP_SIZE;
+
+    start = pa_alloc_contig(pages, align, max_paddr);
+    if(start == 0)
+        return NULL;
+
+    *paddr = start;
+    return phys_to_virt(start);
+}
+
+void dma_free(void * vaddr, uint32_t size) {
+    uint32_t paddr = (uint32_t) vaddr - PHYS_MAP_BASE;
+    uint32_t end = paddr + size;
+
+    for(; paddr < end; paddr += PAGE_SIZE)
+        pa_free(paddr);
+}
+
+/* Physical address of buf if it is contiguous and ends below max_paddr,
+   0 otherwise */
+static uint32_t dma_safe_addr(void * buf, uint32_t size, uint32_t max_paddr) {
+    uint32_t start = (uint32_t) get_physaddr(buf);
+    uint32_t offset;
+
+    if(start == 0 || start + size > max_paddr)
+        return 0;
+    /* Every following page has to be the next frame */
+    for(offset = PAGE_SIZE - (start & ~PAGE_MASK); offset < size; offset += PAGE_SIZE) {
+        if((uint32_t) get_physaddr((uint8_t *) buf + offset) != start + offset)
+            return 0;
+    }
+    return start;
+}
+
+uint32_t dma_map(dma_map_t * map, void * buf, uint32_t size, uint32_t max_paddr, uint32_t dir) {
+    /* ISA transfers must not cross a 64 KiB boundary either */
+    uint32_t align = (max_paddr <= DMA_ISA_LIMIT) ? DMA_ISA_BOUNDARY : PAGE_SIZE;
+
+    map->dm_buf = buf;
+    map->dm_size = size;
+    map->dm_dir = dir;
+    map->dm_bounce = NULL;
+    map->dm_paddr = 0;
+
+    /* ...so a bigger one can't be done in a single transfer at all */
+    if(align == DMA_ISA_BOUNDARY && size > DMA_ISA_BOUNDARY)
+        return 0;
+
+    map->dm_paddr = dma_safe_addr(buf, size, max_paddr);
+    if(map->dm_paddr != 0 && (align == PAGE_SIZE ||
+       (map->dm_paddr & ~(DMA_ISA_BOUNDARY - 1)) == ((map->dm_paddr + size - 1) & ~(DMA_ISA_BOUNDARY - 1))))
+        return map->dm_paddr;
+
+    map->dm_bounce = dma_alloc(size, align, max_paddr, &map->dm_paddr);
+    if(map->dm_bounce == NULL)
+        return 0;
+    if(dir & DMA_TO_DEVICE)
+        memcpy((uint8_t *) map->dm_bounce, (uint8_t *) buf, size);
+    return map->dm_paddr;
+}
+
+void dma_unmap(dma_map_t * map) {
+    if(map->dm_bounce == NULL)
+        return;
+    if(map->dm_dir & DMA_FROM_DEVICE)
+        memcpy((uint8_t *) map->dm_buf, (uint8_t *) map->dm_bounce, map->dm_size);
+    dma_free(map->dm_bounce, map->dm_size);
+    map->dm_bounce = NULL;
+}
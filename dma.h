@@ -0,0 +1,47 @@
+/*
+ * File:   dma.h
+ *
+ *  DMA buffers: physically contiguous memory under a device address
+ *  limit, and bounce buffers for transfers from memory that is not.
+ */
+
+#ifndef DMA_H
+#define DMA_H
+
+#include "common.h"
+
+#define DMA_ISA_LIMIT       0x1000000   /* ISA DMA only reaches 16 MiB */
+#define DMA_ISA_BOUNDARY    0x10000     /* ...and can't cross 64 KiB */
+
+/* Transfer directions for dma_map() */
+#define DMA_TO_DEVICE       1
+#define DMA_FROM_DEVICE     2
+
+/* A buffer prepared for a device by dma_map() */
+struct dma_map_s {
+    void * dm_buf;                      /* Caller buffer */
+    uint32_t dm_size;
+    uint32_t dm_dir;                    /* DMA_TO_DEVICE and/or DMA_FROM_DEVICE */
+    void * dm_bounce;                   /* Bounce buffer, or NULL */
+    uint32_t dm_paddr;                  /* Address to program the device with */
+};
+
+typedef struct dma_map_s dma_map_t;
+
+/* Allocate size bytes of contiguous memory aligned to align, ending at
+   or below max_paddr. Returns the kernel address and stores the
+   physical one in *paddr, or returns NULL */
+void * dma_alloc(uint32_t size, uint32_t align, uint32_t max_paddr, uint32_t * paddr);
+
+/* Release a buffer from dma_alloc() */
+void dma_free(void * vaddr, uint32_t size);
+
+/* Get a device address for buf, bouncing it if it is not contiguous
+   or not below max_paddr. Returns 0 if no bounce buffer was available,
+   or if an ISA transfer (max_paddr <= DMA_ISA_LIMIT) is over 64 KiB */
+uint32_t dma_map(dma_map_t * map, void * buf, uint32_t size, uint32_t max_paddr, uint32_t dir);
+
+/* Finish a transfer started with dma_map(), in the same address space */
+void dma_unmap(dma_map_t * map);
+
+#endif
@@ -10,6 +10,8 @@
 #include "pmm.h"
 #include "cpu.h"
 #include "task.h"
+#include "trace.h"
+#include "irqstat.h"
 
 extern int k_reenter;
 extern uint32_t sched_state;
@@ -132,10 +134,14 @@ static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags
 // And only involves a system call or a severe error
 
 void idt_handler(registers_t *regs) {
+    uint32_t int_no = regs->int_no;
+    uint64_t start;
 
     k_reenter++;
+    start = irq_stat_begin(k_reenter);
     if (interrupt_handlers [regs->int_no]) {
         interrupt_handlers [regs->int_no] (regs);
+        irq_stat_end(int_no, start);
     } else {
         sprintf(except_buf, "Unhandled exception %d.\n", regs->int_no);
         panic(except_buf);
@@ -158,19 +164,28 @@ void register_interrupt_handler(uint8_t n, interrupt_handler_t h) {
 
 void irq_handler(registers_t *regs) {
     int int_no = regs->int_no;
+    uint64_t start;
+    
+    // Spurious IRQ7/IRQ15: not in service, so no handler and no EOI
+    if (irq_spurious(int_no))
+        return;
     
     k_reenter++;
+    trace_event(TRACE_IRQ_ENTRY, int_no - 32);
+    start = irq_stat_begin(k_reenter);
     
     asm volatile("sti");
     // Call the interrupt request kernel handler function
     if (interrupt_handlers[regs->int_no] != 0) {
         interrupt_handlers[regs->int_no] (regs);
+        irq_stat_end(int_no, start);
     } else {
         panic("Unhandled hardware interrupt.\n");
     }
     
     // Try to invoke the scheduler, if needed.
     asm volatile("cli");
+    trace_event(TRACE_IRQ_EXIT, int_no - 32);
     if (sched_state & NEED_SCHEDULE) {
         // Check the "schedule needed" flag
         // If the flag is set, call the scheduler
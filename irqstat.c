@@ -0,0 +1,79 @@
+/* irqstat.c - Krypton interrupt statistics
+ *
+ * irq_stats_dump() prints, for every vector that fired:
+ *
+ *   IRQSTAT vec=<n> count=<n> avg_us=<us> max_us=<us> hist=<b0>,<b1>,...
+ *
+ * followed by an "IRQSTAT nesting=<depth> spurious7=<n> spurious15=<n>"
+ * summary line.
+ */
+
+#include "irqstat.h"
+#include "idt.h"
+#include "timer.h"
+#include "serial.h"
+#include "kprintf.h"
+
+#define PIC_MASTER      0x20
+#define PIC_SLAVE       0xA0
+#define PIC_READ_ISR    0x0B
+#define PIC_EOI         0x20
+
+irq_stats_t irq_stats[256];
+uint32_t irq_max_nesting;
+uint32_t irq_spurious_master;
+uint32_t irq_spurious_slave;
+
+/* A spurious interrupt is raised on the lowest priority line of a PIC
+   when the request went away before it was acknowledged; the in-service
+   bit of that line is then clear */
+uint32_t irq_spurious(uint32_t vector) {
+    if (vector == IRQ7) {
+        outb(PIC_MASTER, PIC_READ_ISR);
+        if (!(inb(PIC_MASTER) & 0x80)) {
+            irq_spurious_master++;
+            return 1;
+        }
+    } else if (vector == IRQ15) {
+        outb(PIC_SLAVE, PIC_READ_ISR);
+        if (!(inb(PIC_SLAVE) & 0x80)) {
+            /* The master did see a real request on the cascade line */
+            outb(PIC_MASTER, PIC_EOI);
+            irq_spurious_slave++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void get_irq_stats(uint32_t vector, irq_stats_t * stats) {
+    disable();
+    memcpy((uint8_t *) stats, (uint8_t *) &irq_stats[vector & 0xFF], sizeof(irq_stats_t));
+    enable();
+}
+
+void irq_stats_dump() {
+    irq_stats_t st;
+    uint32_t vector, i, mhz = tsc_mhz();
+    char line[160];
+    char * p;
+
+    if (mhz == 0)
+        mhz = 1;
+    for (vector = 0; vector < 256; vector++) {
+        get_irq_stats(vector, &st);
+        if (st.is_count == 0)
+            continue;
+        sprintf(line, "IRQSTAT vec=%u count=%u avg_us=%u max_us=%u hist=", vector, st.is_count,
+                (uint32_t) (st.is_total_cycles / st.is_count) / mhz, st.is_max_cycles / mhz);
+        for (i = 0; i < IRQ_HIST_BUCKETS; i++) {
+            p = line + strlen(line);
+            sprintf(p, i ? ",%u" : "%u", st.is_hist[i]);
+        }
+        strcat(line, "\n");
+        serial_write(line);
+    }
+    sprintf(line, "IRQSTAT nesting=%u spurious7=%u spurious15=%u\n",
+            irq_max_nesting, irq_spurious_master, irq_spurious_slave);
+    serial_write(line);
+}
@@ -0,0 +1,69 @@
+/*
+ * File:   irqstat.h
+ *
+ *  Per-vector interrupt statistics: how often each vector fired and
+ *  how long its handler ran, measured with the TSC. Handler times
+ *  include any interrupts that nested inside them.
+ */
+
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include "common.h"
+#include "cpu.h"
+
+/* Bucket 0 is under 256 cycles, bucket n covers [2^(n+7), 2^(n+8))
+   cycles and the last one everything slower */
+#define IRQ_HIST_BUCKETS    16
+
+struct irq_stats_s {
+    uint32_t is_count;
+    uint32_t is_max_cycles;                 /* Watermark of one run */
+    uint64_t is_total_cycles;
+    uint32_t is_hist[IRQ_HIST_BUCKETS];
+};
+
+typedef struct irq_stats_s irq_stats_t;
+
+extern irq_stats_t irq_stats[256];
+/* Deepest interrupt nesting seen, 1 being a plain interrupt */
+extern uint32_t irq_max_nesting;
+/* Spurious IRQ7 and IRQ15 interrupts, dropped without running a handler */
+extern uint32_t irq_spurious_master;
+extern uint32_t irq_spurious_slave;
+
+/* Called on handler entry with the new k_reenter value */
+static inline uint64_t irq_stat_begin(int k_reenter) {
+    if ((uint32_t) (k_reenter + 1) > irq_max_nesting)
+        irq_max_nesting = k_reenter + 1;
+    return (cpu_features_edx & CPU_FEAT_TSC) ? rdtsc() : 0;
+}
+
+static inline void irq_stat_end(uint32_t vector, uint64_t start) {
+    irq_stats_t * st = &irq_stats[vector & 0xFF];
+    uint32_t cycles = 0, bucket;
+
+    if (start != 0)
+        cycles = (uint32_t) (rdtsc() - start);
+    bucket = (cycles >> 8) ? 32 - __builtin_clz(cycles >> 8) : 0;
+    if (bucket >= IRQ_HIST_BUCKETS)
+        bucket = IRQ_HIST_BUCKETS - 1;
+    st->is_count++;
+    st->is_total_cycles += cycles;
+    st->is_hist[bucket]++;
+    if (cycles > st->is_max_cycles)
+        st->is_max_cycles = cycles;
+}
+
+/* Check the PIC in-service register for IRQ7 and IRQ15. Returns
+   non-zero, after sending whatever EOI the PICs still need, if the
+   interrupt was spurious and must not be handled */
+uint32_t irq_spurious(uint32_t vector);
+
+/* Copy the statistics of one vector */
+void get_irq_stats(uint32_t vector, irq_stats_t * stats);
+
+/* Write a line for every vector that fired to the serial port */
+void irq_stats_dump();
+
+#endif
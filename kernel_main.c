@@ -13,6 +13,11 @@
 #include "syscalls.h"
 #include "console.h"
 #include "device.h"
+#include "bench.h"
+#include "trace.h"
+#include "profile.h"
+#include "serial.h"
+#include "log.h"
 
 
 /* Check if the compiler thinks if we are targeting the wrong operating system. */
@@ -30,6 +35,7 @@ extern uint32_t LowRamFreeCount;
 extern uint32_t HighRamFreeCount;
 extern list_head_t tasks_ready;
 extern list_head_t tasks_wait;
+extern list_head_t tasks_all;
 extern task_t * running_task;
 extern int wait_lock;
 extern list_head_t device_list;
@@ -39,16 +45,36 @@ uint32_t kernel_stack[KERNEL_STACK_SIZE_WORDS] __attribute__((aligned(4096)));
 task_t kernel_task;
 extern int forbid_counter;
 extern int k_reenter;
-extern device_t keybd_device;
 
 char buf[32];
 iorq_t con_io;
+device_t * con_dev;
+/* Copy of the multiboot command line, its memory is not reserved */
+char kernel_cmdline[128];
+
+/* Non-zero if word is one of the blank separated command line words */
+static int cmdline_has(const char * word) {
+    const char * p = kernel_cmdline;
+    int i;
+
+    while(*p) {
+        for(i = 0; word[i] && p[i] == word[i]; i++);
+        if(word[i] == '\0' && (p[i] == ' ' || p[i] == '\0'))
+            return 1;
+        while(*p && *p != ' ')
+            p++;
+        while(*p == ' ')
+            p++;
+    }
+    return 0;
+}
 
 
 void * timer_task(void * arg) {
     int hours = 0, mins = 0, seconds = 0;
     static char timebuf[30];
     static char rambuf[30];
+    static char cpubuf[40];
     
     monitor_writexy(0, 24, "                                                                                ", 7, 0);
     while(1) {
@@ -56,6 +82,8 @@ void * timer_task(void * arg) {
         sprintf(rambuf, "%8d kB RAM free", LowRamFreeCount * 4 + HighRamFreeCount * 4);
         monitor_writexy(70, 24, timebuf, 7, 0);
         monitor_writexy(5, 24, rambuf, 7, 0);
+        sched_status(cpubuf);
+        monitor_writexy(28, 24, cpubuf, 7, 0);
         if (seconds == 60) {
             seconds = 0;
             mins++;
@@ -68,29 +96,70 @@ void * timer_task(void * arg) {
     }
 }
 
+/* Start a task the system cannot do without, there is nothing to fall
+   back on if that fails */
+static void start_task(void* (*code)(void*), char * name, uint32_t pri) {
+    static char msg[64];
+
+    if(create_task(code, name, pri, 0x4000) == NULL) {
+        sprintf(msg, "cannot create task %s", name);
+        panic(msg);
+    }
+}
+
 /* init - Krypton microkernel initialization function 
 */
 
 void init(multiboot_t * mboot_ptr) {
+    int i;
+
     // Initialize the memory manager and interrupts
     mm_init(mboot_ptr); 
+    // Save the command line before the page allocator can reuse it.
+    // Like the memory map, it is reached through the low identity map
+    if(mboot_ptr->flags & MULTIBOOT_FLAG_CMDLINE) {
+        char * cmdline = (char *) mboot_ptr->cmdline;
+        for(i = 0; i < (int) sizeof(kernel_cmdline) - 1 && cmdline[i]; i++)
+            kernel_cmdline[i] = cmdline[i];
+    }
     monitor_init();
     kheap_init();
     register_interrupt_handler(255, &syscall);
     init_timer(50);
+    trace_init();
+    profile_init();
     strcpy(kernel_task.ln_link.name, kernel_task_name);
     kernel_task.ln_link.pri = 0;
     new_list(&tasks_ready);
     new_list(&tasks_wait);
-    new_list(&device_list);
+    new_list(&tasks_all);
+    add_tail(&tasks_all, (list_node_t *) &kernel_task.all_link);
+    init_device_list();
     set_kernel_stack( ((uint32_t) kernel_stack) + KERNEL_STACK_SIZE_WORDS * sizeof(uint32_t));
     running_task = &kernel_task;
     running_task->flags |= TS_READY | TS_RUN; 
+    init_msgport(&kernel_task.reply_port, &kernel_task);
+    kernel_task.page_dir = kernelpagedirPtr;
+    new_list(&kernel_task.vm_regions);
     forbid_counter = 0;
     k_reenter = -1;
     wait_lock = 0;
-    create_task(console_device, "org.era.dev.console", 0, 1000);
-    create_task(timer_task, "org.era.timetask", 10 , 1000);
+    // Benchmark runs get the machine to themselves
+    if(cmdline_has("bench")) {
+        start_task(bench_task, "org.era.bench", BENCH_PRI);
+        enter_user_mode();
+        while(1)
+            wait(TB_RESUME, &tasks_wait);
+    }
+    start_task(console_device, "org.era.dev.console", 0);
+    start_task(serial_device, "org.era.dev.serial", 0);
+    start_task(log_writer, "org.era.log", LOG_WRITER_PRI);
+    // Copy the console output to COM1, for headless runs
+    if(cmdline_has("serial"))
+        kprintf_sink = serial_kprintf_sink;
+    if(cmdline_has("debug"))
+        log_set_level(LOG_SYS_COUNT, LOG_DEBUG);
+    start_task(timer_task, "org.era.timetask", 10);
     
     
     enter_user_mode();
@@ -98,6 +167,9 @@ void init(multiboot_t * mboot_ptr) {
     
     delay(25);
     
+    while((con_dev = open_device("org.era.dev.console")) == NULL)
+        delay(1);
+    
     memset(&con_io, 0, sizeof(iorq_t));
     con_io.io_desc = DC_READ;
     con_io.io_sz = 32;
@@ -105,7 +177,7 @@ void init(multiboot_t * mboot_ptr) {
     
     while(1) {
         kprintf("root@localhost:/ # ");
-        do_io(&keybd_device, &con_io);
+        do_io(con_dev, &con_io);
         if(strlen(buf) != 0)
             kprintf("bash: %s: No such file or directory\n", buf);
     }
@@ -13,18 +13,50 @@
 #include "kmalloc.h"
 #include "syscalls.h"
 #include "mm.h"
+#include "cpu.h"
+#include "trace.h"
+#ifdef CONFIG_KMALLOC_DEBUG
+#include "task.h"
+#include "timer.h"
+#include "log.h"
+
+extern task_t * running_task;
+#endif
 
 /* Virtual memory heap starting address */
 #define HEAP_START       (unsigned long)     0xC0400000
+/* Free pages kept at the heap end after a kfree(), so that the next
+   allocations don't have to map them again. Only memory pressure
+   gives them back */
+#define HEAP_TRIM_SLACK  (4 * PAGE_SIZE)
 
 list_head_t k_heap_start;
 uint32_t k_heap_end;
+/* Set while the heap is being grown, so it is not trimmed under us */
+static uint32_t k_heap_growing;
+static mem_handler_t k_heap_mem_handler;
+static kheap_stats_t k_heap_stats;
 
 /* Static prototypes */
 
 static void insert_chunk(chunk_t * chunk);
 static void merge_heap();
 static void merge_heap(chunk_t *aux);
+static void trim_heap(uint32_t slack);
+static uint32_t heap_mem_handler(uint32_t level, void * data);
+
+/* Size class of a chunk: 16 bytes or less is class 0, 1K or more the last */
+static inline uint32_t size_class(uint32_t size) {
+    uint32_t cls = (size > 16) ? 32 - __builtin_clz(size - 1) - 4 : 0;
+
+    return (cls < KHEAP_CLASSES) ? cls : KHEAP_CLASSES - 1;
+}
+
+#ifdef CONFIG_KMALLOC_DEBUG
+#define CHUNK_SET_FREE(chunk)	((chunk)->owner = NULL)
+#else
+#define CHUNK_SET_FREE(chunk)	do { } while (0)
+#endif
 
 
 /* kkeap_init()
@@ -39,6 +71,11 @@ void
 kheap_init () {
     new_list((list_head_t *) &k_heap_start);
     k_heap_end = HEAP_START;
+
+    strcpy(k_heap_mem_handler.ln_link.name, "kernel heap");
+    k_heap_mem_handler.ln_link.pri = 50;
+    k_heap_mem_handler.mh_code = heap_mem_handler;
+    add_mem_handler(&k_heap_mem_handler);
 }
 
 void
@@ -74,10 +111,14 @@ _kfree (void* ptr)
 			panic("kernel heap corruption detected");
     }
     
-    asm volatile("cli");
+    disable();
+    k_heap_stats.frees[size_class(chunk->size)]++;
+    k_heap_stats.in_use -= chunk->size;
+    CHUNK_SET_FREE(chunk);
     insert_chunk(chunk);
     merge_heap(get_head((list_head_t *) &k_heap_start));
-    asm volatile("sti");
+    trim_heap(HEAP_TRIM_SLACK);
+    enable();
 }
 
 void kfree(void * ptr) {
@@ -88,6 +129,11 @@ void * kmalloc(uint32_t alloc_sz) {
     uint32_t aux = alloc_sz;
     system_call(SYSCALL_KMALLOC, &aux);
     
+#ifdef CONFIG_KMALLOC_DEBUG
+    /* _kmalloc() only saw the system call handler */
+    if (aux != 0)
+        ((chunk_t *) (aux - sizeof(chunk_t)))->caller = (uint32_t) __builtin_return_address(0);
+#endif
     return aux;
 }
 
@@ -98,6 +144,8 @@ _kmalloc (uint32_t alloc_sz) {
 	chunk_t *next_chunk, *new_chunk;
 	uint32_t next_chunk_addr, chunk_addr, new_chunk_addr;
 	uint32_t heap_end_addr = k_heap_end;
+
+	trace_event(TRACE_KMALLOC, alloc_sz);
 	/* Allocation size has to be properly aligned */
 	if (alloc_sz & 0xF)
 	    alloc_sz = (alloc_sz + 0x10) & (~0xF);
@@ -120,7 +168,7 @@ _kmalloc (uint32_t alloc_sz) {
 		   for the next chunk header */
 		/* We will typecast the pointers to integer type, to be able to do pointer
 		   arithmetic correctly */
-		asm volatile("cli");
+		disable();
 		chunk_addr = (uint32_t) chunk;
 		/*  Two cases to watch for: if we are the last node or not */
 		if(next_chunk = (chunk_t *) get_next((list_node_t *) chunk)) {
@@ -145,6 +193,7 @@ _kmalloc (uint32_t alloc_sz) {
 				new_chunk->size = chunk->size - alloc_sz - sizeof(chunk_t);
 				/* Set the magic number, as always */
 				new_chunk->magic = CHUNK_MAGIC;
+				CHUNK_SET_FREE(new_chunk);
 				/* Enqueue the new chunk */
 				insert_chunk(new_chunk);
 				/* Reset the size of this chunk */
@@ -166,6 +215,7 @@ _kmalloc (uint32_t alloc_sz) {
 				new_chunk->size = chunk->size - alloc_sz - sizeof(chunk_t);
 				/* Set the magic number, as always */
 				new_chunk->magic = CHUNK_MAGIC;
+				CHUNK_SET_FREE(new_chunk);
 				/* Enqueue the new chunk */
 				insert_chunk(new_chunk);
 				/* Reset the size of this chunk */
@@ -174,9 +224,19 @@ _kmalloc (uint32_t alloc_sz) {
 		}
 		/* Remove the chunk from the free list */
 		remove(chunk);
+		k_heap_stats.allocs[size_class(chunk->size)]++;
+		k_heap_stats.in_use += chunk->size;
+		if (k_heap_stats.in_use > k_heap_stats.peak_in_use)
+			k_heap_stats.peak_in_use = k_heap_stats.in_use;
+#ifdef CONFIG_KMALLOC_DEBUG
+		chunk->owner = running_task;
+		chunk->caller = (uint32_t) __builtin_return_address(0);
+		chunk->req_size = alloc_sz;
+		chunk->tick = system_tick;
+#endif
 		/* We finished setting up the chunks, so all we need to do
 		   is to return the new chunk address to the caller! */
-		asm volatile("sti");
+		enable();
 
 		return ((void*) (chunk_addr + sizeof(chunk_t)));
 	}
@@ -185,15 +245,32 @@ _kmalloc (uint32_t alloc_sz) {
 	   allocator and map it in front of the current heap end */
 	/* Then we simply resize the last free chunk and recursively
 	   reinvoke the allocator */
-	asm volatile("cli");
-	mm_map(pa_alloc(), heap_end_addr, PAGE_WRITE | PAGE_USER);
+	/* If memory is short, return NULL and let the caller cope */
+	disable();
+	k_heap_growing = 1;
+	if ((new_chunk_addr = pa_alloc()) == 0 ||
+	    mm_map(new_chunk_addr, heap_end_addr, PAGE_WRITE | PAGE_USER) == NULL) {
+		if (new_chunk_addr != 0)
+			pa_free(new_chunk_addr);
+		k_heap_growing = 0;
+		k_heap_stats.failed++;
+		enable();
+		return NULL;
+	}
+	k_heap_growing = 0;
 	/* Reset the heap end address */
 	k_heap_end += PAGE_SIZE;
+	k_heap_stats.grows++;
+	k_heap_stats.heap_size = k_heap_end - HEAP_START;
+	if (k_heap_stats.heap_size > k_heap_stats.peak_heap_size)
+		k_heap_stats.peak_heap_size = k_heap_stats.heap_size;
 	/* Get last chunk from list */
 	new_chunk = (chunk_t *) get_tail((list_head_t *) &k_heap_start);
-	/* Test if the heap was empty before */
-	if(new_chunk) {
-		/* If the heap exists, resize the chunk  */
+	/* Test if the last free chunk reaches the old heap end. It may
+	   be further down, with allocated chunks in front of it */
+	if(new_chunk &&
+	   (uint32_t) new_chunk + sizeof(chunk_t) + new_chunk->size == heap_end_addr) {
+		/* If so, resize the chunk  */
 		new_chunk->size += PAGE_SIZE;
 	} else {
 		/* We need to create a chunk in the heap end
@@ -203,11 +280,12 @@ _kmalloc (uint32_t alloc_sz) {
 		new_chunk->size = k_heap_end - heap_end_addr - sizeof(chunk_t);
 		/* Set the magic number, as always */
 		new_chunk->magic = CHUNK_MAGIC;
+		CHUNK_SET_FREE(new_chunk);
 		/* Enqueue the new chunk */
 		add_tail(&k_heap_start, new_chunk);
 	}
 	/* Recurse to retry the allocation */
-	asm volatile("sti");
+	enable();
 	return ( _kmalloc(alloc_sz) );
 }
 
@@ -236,10 +314,8 @@ static void insert_chunk(chunk_t * chunk) {
 
 static void merge_heap(chunk_t *aux) {
     chunk_t *aux_next;
-    chunk_t * tail;
     uint32_t aux_addr = (uint32_t) aux;
     uint32_t aux_next_addr;
-    uint32_t free_addr;
     
     if (aux == NULL) return;
     
@@ -258,14 +334,106 @@ static void merge_heap(chunk_t *aux) {
     else {
         merge_heap(get_next(aux));
     }
-    
-    tail = get_tail(&k_heap_start);
-    while((tail != NULL) && (tail->size > PAGE_SIZE)) {
-        tail->size -= PAGE_SIZE;
-        k_heap_end -= PAGE_SIZE;
-        free_addr = get_physaddr(k_heap_end);
-        mm_unmap(k_heap_end);
-        pa_free(free_addr);
+}
+
+/* Give back the whole pages at the end of the heap but slack bytes, if
+   the last free chunk reaches up to the heap end. They all go in one
+   range unmap */
+static void trim_heap(uint32_t slack) {
+    chunk_t * tail = get_tail(&k_heap_start);
+    uint32_t trim_sz;
+
+    if (tail == NULL || (uint32_t) tail + sizeof(chunk_t) + tail->size != k_heap_end)
+        return;
+
+    trim_sz = ((tail->size - 1) / PAGE_SIZE) * PAGE_SIZE;
+    if (trim_sz <= slack)
+        return;
+    trim_sz -= slack;
+    tail->size -= trim_sz;
+    k_heap_end -= trim_sz;
+    k_heap_stats.shrinks++;
+    k_heap_stats.heap_size = k_heap_end - HEAP_START;
+    mm_unmap_range((void *) k_heap_end, trim_sz, MM_UNMAP_FREE);
+}
+
+/* Under memory pressure the heap gives back its slack pages */
+static uint32_t heap_mem_handler(uint32_t level, void * data) {
+    uint32_t old_end = k_heap_end;
+
+    (void) level;
+    (void) data;
+    if (k_heap_growing)
+        return MEM_DID_NOTHING;
+    disable();
+    trim_heap(0);
+    enable();
+    return (k_heap_end != old_end) ? MEM_ALL_DONE : MEM_DID_NOTHING;
+}
+
+/* kheap_get_stats() - copy the heap counters
+ *
+ * The free space figures come from a walk of the free list; largest
+ * free against total free gives the fragmentation.
+ */
+void kheap_get_stats(kheap_stats_t * stats) {
+    chunk_t * chunk;
+
+    disable();
+    memcpy((uint8_t *) stats, (uint8_t *) &k_heap_stats, sizeof(kheap_stats_t));
+    stats->free_bytes = stats->free_chunks = stats->largest_free = 0;
+    for (chunk = get_head(&k_heap_start); chunk != NULL; chunk = get_next((list_node_t *) chunk)) {
+        stats->free_bytes += chunk->size;
+        stats->free_chunks++;
+        if (chunk->size > stats->largest_free)
+            stats->largest_free = chunk->size;
     }
+    enable();
+}
+
+#ifdef CONFIG_KMALLOC_DEBUG
+
+#define LEAK_SITES  8
+
+/* kheap_leak_report() - list what a task still owns
+ *
+ * Chunks tile the heap from HEAP_START to k_heap_end, so every one of
+ * them is found by stepping over the sizes. Once LEAK_SITES call sites
+ * are in the table the rest are summed under address 0.
+ */
+void kheap_leak_report(task_t * task) {
+    uint32_t sites[LEAK_SITES], bytes[LEAK_SITES], chunks[LEAK_SITES];
+    uint32_t addr, i, nsites = 0, total = 0, count = 0;
+    chunk_t * chunk;
+
+    disable();
+    for (addr = HEAP_START; addr < k_heap_end; addr += sizeof(chunk_t) + chunk->size) {
+        chunk = (chunk_t *) addr;
+        if (chunk->magic != CHUNK_MAGIC)
+            panic("kernel heap corruption detected");
+        if (chunk->owner != task)
+            continue;
+        for (i = 0; i < nsites && sites[i] != chunk->caller; i++)
+            ;
+        if (i == nsites && nsites == LEAK_SITES) {
+            i = LEAK_SITES - 1;
+            sites[i] = 0;
+        } else if (i == nsites) {
+            sites[nsites++] = chunk->caller;
+            bytes[i] = chunks[i] = 0;
+        }
+        bytes[i] += chunk->req_size;
+        chunks[i]++;
+        total += chunk->req_size;
+        count++;
+    }
+    enable();
+
+    if (count == 0)
+        return;
+    klog(LOG_SYS_MM, LOG_WARN, "task %s leaves %d bytes in %d chunks\n", task->ln_link.name, total, count);
+    for (i = 0; i < nsites; i++)
+        klog(LOG_SYS_MM, LOG_WARN, "  %8d bytes in %4d chunks from 0x%08X\n", bytes[i], chunks[i], sites[i]);
 }
 
+#endif /* CONFIG_KMALLOC_DEBUG */
@@ -14,6 +14,13 @@
  */
 #define HEAP_ADDR		0xC0400000
 
+/*!
+ * Allocation size classes: 16, 32, ... 1024 bytes and larger
+ */
+#define KHEAP_CLASSES	8
+
+struct task_s;
+
 /*!
  * The basic chunk structure, linkable in a list
  * ordered by address
@@ -22,10 +29,37 @@ struct chunk_s {
 	min_node_t mn_link;  //! Link to other chunks in a ordered list
 	uint32_t size;       //! Size of this chunk
 	uint32_t magic;      //! Magic number for consistency checking
+#ifdef CONFIG_KMALLOC_DEBUG
+	uint32_t caller;     //! Return address of the allocating call
+	struct task_s * owner; //! Allocating task, NULL while free
+	uint32_t req_size;   //! Size asked for
+	uint32_t tick;       //! system_tick at allocation
+#endif
 };
 
 typedef struct chunk_s chunk_t;
 
+/*!
+ * Heap counters, since boot. Sizes are chunk sizes, headers excluded
+ */
+struct kheap_stats_s {
+	uint32_t allocs[KHEAP_CLASSES];
+	uint32_t frees[KHEAP_CLASSES];
+	uint32_t failed;         //! Allocations that returned NULL
+	uint32_t in_use;         //! Bytes handed out
+	uint32_t peak_in_use;
+	uint32_t heap_size;      //! Bytes mapped for the heap
+	uint32_t peak_heap_size;
+	uint32_t grows;          //! Pages added to the heap end
+	uint32_t shrinks;        //! Trims of the heap end
+	/* Filled in by kheap_get_stats() from the free list */
+	uint32_t free_bytes;
+	uint32_t free_chunks;
+	uint32_t largest_free;
+};
+
+typedef struct kheap_stats_s kheap_stats_t;
+
 void
 kheap_traverse ();
 
@@ -44,4 +78,17 @@ kfree (void* ptr);
 void
 _kfree (void* ptr);
 
+void
+kheap_get_stats (kheap_stats_t * stats);
+
+#ifdef CONFIG_KMALLOC_DEBUG
+/*!
+ * Print the chunks a task still owns, grouped by call site
+ */
+void
+kheap_leak_report (struct task_s * task);
+#else
+#define kheap_leak_report(task)	do { } while (0)
+#endif
+
 #endif /* _KMALLOC_H */
@@ -1,21 +1,19 @@
 #include "monitor.h"
 #include "kprintf.h"
 #include "vsprintf.h"
+#include "log.h"
 #include <stdarg.h>
 
+void (*kprintf_sink) (const char *buf, uint32_t len);
+
+/* Formats on the caller's stack and goes through the kernel log */
 void kprintf (const char *fmt, ...)
 {
-	static char buf [1024];
-
  	va_list args;
- 	int i;
  
  	va_start(args, fmt);
- 	i = vsprintf(buf,fmt,args);
+ 	vklog(LOG_SYS_KERNEL, LOG_INFO, fmt, args);
  	va_end(args);
-
- 	buf[i] = '\0';
- 	monitor_write (buf);
 }
 
 void sprintf (char *buf, const char *fmt, ...)
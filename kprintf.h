@@ -6,6 +6,12 @@
 #ifndef _KPRINTF_H
 #define _KPRINTF_H
 
+#include "common.h"
+
+/* Extra destination for log output besides the screen, NULL if none.
+   Must not block, it may be called from interrupt handlers */
+extern void (*kprintf_sink) (const char *buf, uint32_t len);
+
 void kprintf (const char *fmt, ...);
 
 void sprintf (char *buf, const char *fmt, ...);
@@ -0,0 +1,158 @@
+/* log.c - Krypton kernel log
+ *
+ * The ring follows the bounded queue with per-slot sequence numbers:
+ * a slot is free for position pos while lr_seq holds the lap base of
+ * pos (pos & ~LOG_RING_MASK), and published once it holds base + 1.
+ * Producers claim a position with a compare and swap on log_head, so
+ * they never wait on each other, nor on the writer. A producer that
+ * finds the slot still published from the previous lap drops its
+ * message and counts it in log_dropped.
+ */
+
+#include "log.h"
+#include "atomic.h"
+#include "monitor.h"
+#include "kprintf.h"
+#include "vsprintf.h"
+#include "serial.h"
+#include "task.h"
+
+#define LOG_RING_MASK   (LOG_RING_SIZE - 1)
+
+struct log_rec_s {
+    volatile int32_t lr_seq;
+    char lr_text[LOG_MSG_MAX];
+};
+
+typedef struct log_rec_s log_rec_t;
+
+uint32_t log_levels[LOG_SYS_COUNT] = {
+    [0 ... LOG_SYS_COUNT - 1] = LOG_INFO
+};
+volatile int32_t log_dropped;
+
+static log_rec_t log_ring[LOG_RING_SIZE];
+static volatile int32_t log_head;
+static int32_t log_tail;            // Only the writer moves it
+static volatile uint32_t log_async; // The writer task is running
+static volatile uint32_t log_emerg;
+
+static const char * level_tags[] = {
+    "PANIC: ", "error: ", "warning: ", "", "debug: "
+};
+
+/* Put text on the screen and the sink. In an emergency the serial port
+   is polled, the interrupt driven ring may never drain again */
+static void log_emit(char * text, uint32_t len) {
+    monitor_write(text);
+    if (kprintf_sink == NULL)
+        return;
+    if (log_emerg)
+        serial_write(text);
+    else
+        kprintf_sink(text, len);
+}
+
+static void log_enqueue(char * text, uint32_t len) {
+    log_rec_t * rec;
+    int32_t pos, lap;
+
+    for (;;) {
+        pos = log_head;
+        lap = pos & ~LOG_RING_MASK;
+        rec = &log_ring[pos & LOG_RING_MASK];
+        if (rec->lr_seq == lap) {
+            if (atomic_cmpxchg(&log_head, pos, pos + 1))
+                break;
+        } else if (rec->lr_seq - lap < 0) {
+            // Still holds a message from the previous lap
+            atomic_add(&log_dropped, 1);
+            return;
+        }
+        // Another producer got there first, try the next position
+    }
+    memcpy((uint8_t *) rec->lr_text, (uint8_t *) text, len + 1);
+    asm volatile("" ::: "memory");
+    rec->lr_seq = lap + 1;
+}
+
+/* Write out the oldest published message, 0 if there is none */
+static uint32_t log_drain_one() {
+    log_rec_t * rec = &log_ring[log_tail & LOG_RING_MASK];
+    int32_t lap = log_tail & ~LOG_RING_MASK;
+
+    if (rec->lr_seq != lap + 1)
+        return 0;
+    log_emit(rec->lr_text, strlen(rec->lr_text));
+    asm volatile("" ::: "memory");
+    rec->lr_seq = lap + LOG_RING_SIZE;
+    log_tail++;
+    return 1;
+}
+
+void vklog(uint32_t subsys, uint32_t level, const char * fmt, va_list args) {
+    char buf[LOG_MSG_MAX];
+    uint32_t len;
+
+    if (subsys >= LOG_SYS_COUNT || level > log_levels[subsys])
+        return;
+    strcpy(buf, level_tags[level]);
+    len = strlen(buf);
+    len += vsnprintf(buf + len, LOG_MSG_MAX - len, fmt, args);
+    if (len >= LOG_MSG_MAX) {
+        // Truncated, but keep the line break the message ended with
+        len = LOG_MSG_MAX - 1;
+        if (fmt[strlen((char *) fmt) - 1] == '\n')
+            buf[len - 1] = '\n';
+    }
+
+    if (log_async && !log_emerg)
+        log_enqueue(buf, len);
+    else
+        log_emit(buf, len);
+}
+
+void klog(uint32_t subsys, uint32_t level, const char * fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vklog(subsys, level, fmt, args);
+    va_end(args);
+}
+
+void log_set_level(uint32_t subsys, uint32_t level) {
+    uint32_t i;
+
+    if (level > LOG_DEBUG)
+        level = LOG_DEBUG;
+    for (i = 0; i < LOG_SYS_COUNT; i++)
+        if (subsys == i || subsys == LOG_SYS_COUNT)
+            log_levels[i] = level;
+}
+
+void log_emergency() {
+    log_emerg = 1;
+    // Whatever was published is older than the panic message
+    while (log_drain_one())
+        ;
+}
+
+void * log_writer(void * arg) {
+    char buf[48];
+    int32_t dropped, reported = 0;
+
+    (void) arg;
+    log_async = 1;
+    for (;;) {
+        while (!log_emerg && log_drain_one())
+            ;
+        dropped = log_dropped;
+        if (dropped != reported) {
+            sprintf(buf, "[log: %d messages dropped]\n", dropped - reported);
+            log_emit(buf, strlen(buf));
+            reported = dropped;
+        }
+        delay(1);
+    }
+    return NULL;
+}
@@ -0,0 +1,57 @@
+/*
+ * File:   log.h
+ *
+ *  Kernel log. Producers format on their own stack and claim a slot in
+ *  a lock-free ring; the "org.era.log" task writes the ring out to the
+ *  screen and to kprintf_sink. Until that task runs, and again once
+ *  log_emergency() has been called, messages are written on the spot.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include "common.h"
+#include <stdarg.h>
+
+/* Severity, lower is more severe */
+#define LOG_EMERG       0
+#define LOG_ERR         1
+#define LOG_WARN        2
+#define LOG_INFO        3
+#define LOG_DEBUG       4
+
+/* Subsystems, each with its own level filter */
+#define LOG_SYS_KERNEL  0
+#define LOG_SYS_MM      1
+#define LOG_SYS_SCHED   2
+#define LOG_SYS_IRQ     3
+#define LOG_SYS_DEV     4
+#define LOG_SYS_COUNT   5
+
+#define LOG_MSG_MAX     160     /* Longest message, formatted on the stack */
+#define LOG_RING_SIZE   128     /* Messages in flight, a power of two */
+#define LOG_WRITER_PRI  -10
+
+/* Most verbose level let through, per subsystem. LOG_INFO by default */
+extern uint32_t log_levels[LOG_SYS_COUNT];
+
+/* Messages lost to a full ring */
+extern volatile int32_t log_dropped;
+
+/* Log a message if subsys lets level through */
+void klog(uint32_t subsys, uint32_t level, const char * fmt, ...);
+
+void vklog(uint32_t subsys, uint32_t level, const char * fmt, va_list args);
+
+/* Set the filter of one subsystem, or of all with LOG_SYS_COUNT. Levels
+   past LOG_DEBUG are clamped, so klog() never lets them through */
+void log_set_level(uint32_t subsys, uint32_t level);
+
+/* Write out what is queued and log synchronously from now on, with
+   polled serial output. For panics, may run with interrupts off */
+void log_emergency();
+
+/* The writer task */
+void * log_writer(void * arg);
+
+#endif
@@ -0,0 +1,64 @@
+/* memstat.c - Krypton memory statistics report
+ *
+ * Reports the heap and frame allocator counters, with the
+ * frame allocation rates since the previous report.
+ */
+
+#include "memstat.h"
+#include "kmalloc.h"
+#include "mm.h"
+#include "timer.h"
+#include "kprintf.h"
+#include "task.h"
+#include "vsprintf.h"
+#include <stdarg.h>
+
+extern uint32_t LowRamFreeCount;
+
+static void report(void (*out)(const char * line), const char * fmt, ...) {
+    char line[128];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (out != NULL)
+        out(line);
+    else
+        kprintf("%s", line);
+}
+
+void mem_stats_report(void (*out)(const char * line)) {
+    static uint32_t last_tick, last_allocs, last_frees;
+    static const char * class_names[KHEAP_CLASSES] = {
+        "16", "32", "64", "128", "256", "512", "1K", ">1K"
+    };
+    kheap_stats_t ks;
+    pa_stats_t ps;
+    uint32_t i, secs, frag;
+
+    kheap_get_stats(&ks);
+    forbid();
+    memcpy((uint8_t *) &ps, (uint8_t *) &pa_stats, sizeof(pa_stats_t));
+    permit();
+
+    /* Share of the free heap that is not in the largest chunk */
+    frag = ks.free_bytes ? 1000 - (uint32_t) ((uint64_t) ks.largest_free * 1000 / ks.free_bytes) : 0;
+    report(out, "heap: %d in use (peak %d), %d mapped (peak %d), %d grows, %d shrinks, %d failed\n",
+            ks.in_use, ks.peak_in_use, ks.heap_size, ks.peak_heap_size, ks.grows, ks.shrinks, ks.failed);
+    report(out, "heap: %d free in %d chunks, largest %d, fragmentation %d.%d%%\n",
+            ks.free_bytes, ks.free_chunks, ks.largest_free, frag / 10, frag % 10);
+    report(out, "size   allocs    frees\n");
+    for (i = 0; i < KHEAP_CLASSES; i++)
+        report(out, "%4s %8d %8d\n", class_names[i], ks.allocs[i], ks.frees[i]);
+
+    secs = (system_tick - last_tick) / timer_frequency;
+    if (secs == 0)
+        secs = 1;
+    report(out, "frames: %d free (min %d), %d allocs/s, %d frees/s, %d failed\n",
+            LowRamFreeCount, ps.ps_min_free, (ps.ps_allocs - last_allocs) / secs,
+            (ps.ps_frees - last_frees) / secs, ps.ps_failed);
+    last_tick = system_tick;
+    last_allocs = ps.ps_allocs;
+    last_frees = ps.ps_frees;
+}
@@ -0,0 +1,17 @@
+/*
+ * File:   memstat.h
+ *
+ *  Report of the kernel heap and frame allocator counters.
+ */
+
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include "common.h"
+
+/* Print the heap and frame statistics, a line at a time through out, or
+   on the console if out is NULL. Rates cover the time since the previous
+   call */
+void mem_stats_report(void (*out)(const char * line));
+
+#endif
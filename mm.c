@@ -10,13 +10,36 @@
 #include "common.h"
 #include "panic.h"
 #include "kprintf.h"
+#include "log.h"
 #include "idt.h"
 #include "syscalls.h"
+#include "task.h"
+#include "kmalloc.h"
+#include "trace.h"
  
  
-#define PM_DIR_CLONE_ADDR   (unsigned long *)   0xFE000000
-#define PM_PAGE_CLONE_ADDR  (unsigned long *)   0xFE800000
 #define PM_LOW_PAGE_COUNT                       120
+#define PM_STACK_PDE                            767
+#define PM_KERNEL_FIRST_PDE                     768
+#define PM_PHYS_MAP_PDE     (PHYS_MAP_BASE >> 22)
+#define PM_PHYS_MAP_TABLES  (PHYS_MAP_SIZE >> 22)
+
+#define PM_MANAGED_LIMIT    (PM_LOW_PAGE_COUNT * 32 * PAGE_SIZE)
+
+/* Pre-zeroed frames kept around */
+#define PM_ZERO_POOL_SIZE   32
+
+/* Most single-page invalidations a range operation can queue */
+#define PM_TLB_BATCH_MAX    64
+
+/* Directory entries shared by every address space: the low 4 MiB
+   identity map (VGA, BIOS areas) and the higher half kernel */
+#define IS_KERNEL_PDE(i)    ((i) == 0 || (i) >= PM_KERNEL_FIRST_PDE)
+
+/* The active directory, and the page table behind one of its entries,
+   through the direct map */
+#define PM_ACT_PD()         ((unsigned long *) phys_to_virt(act_page_directory))
+#define PM_PDE_TABLE(pde)   ((unsigned long *) phys_to_virt((pde) & PAGE_MASK))
 
 
 /***************************************
@@ -27,6 +50,20 @@ static inline void flush_tlb(unsigned long virtualaddr);
 
 static void page_fault(registers_t *regs);
 
+static int sync_kernel_pde(unsigned long pdindex);
+
+static int unshare_page_table(unsigned long pdindex);
+
+static int cow_fault(unsigned long addr);
+
+static int demand_fault(unsigned long addr);
+
+static inline void flush_tlb_all();
+
+static inline void flush_tlb_global();
+
+static uint32_t zero_pool_handler(uint32_t level, void * data);
+
 /***************************************
  * Globals
  ***************************************/
@@ -34,14 +71,29 @@ static void page_fault(registers_t *regs);
 unsigned long kernelpagedir[1024] __attribute__((aligned(4096)));
 /* x86-compatible 0-4MiB Page Table container */
 unsigned long lowpagetable[1024] __attribute__((aligned(4096)));
+/* Direct map page tables, only used if the CPU has no PSE */
+unsigned long physmaptables[PM_PHYS_MAP_TABLES][1024] __attribute__((aligned(4096)));
+/* PAGE_GLOBAL if the CPU supports global pages, set on kernel mappings */
+unsigned long pm_global_flag;
+/* Non-zero if the CPU supports 4 MiB pages */
+unsigned int pm_large_pages;
 /* Pointer to the page directory phisical address */
 void *kernelpagedirPtr = 0;
+/* Physical address of the page directory loaded in CR3 */
+pagedir_t * act_page_directory;
 /* Last kernel page physical address */
 uint32_t kernel_seg_end_page;
 /* flag to tell if the virtual memory system is initialized */
 unsigned int vm_online;
 /* Constant defined in the linker script to mark the kernel area end */
 extern unsigned int end;
+/* Above this many pages a range operation reloads CR3 instead of
+   using invlpg on each page */
+uint32_t tlb_flush_threshold = 32;
+/* Called after each batch with the range, for other CPUs to flush */
+void (*tlb_shootdown_hook)(uint32_t start, uint32_t end);
+/* Task whose regions the page fault handler populates */
+extern task_t * running_task;
 
 /* Low-end RAM (<15 MB) free-pages bitfield */
 uint32_t LowRamBitF[PM_LOW_PAGE_COUNT];
@@ -50,6 +102,24 @@ uint32_t LowRamFreeCount;
 /* High end RAM counter */
 uint32_t HighRamFreeCount;
 
+/* Pre-zeroed frame stack, filled from the idle loop */
+static uint32_t ZeroPool[PM_ZERO_POOL_SIZE];
+static volatile uint32_t ZeroPoolCount;
+
+/* Free frame counts below which the memory handlers are called, with
+   MEM_LEVEL_LOW and then MEM_LEVEL_MIN */
+uint32_t pa_low_watermark = 64;
+uint32_t pa_min_watermark = 16;
+/* Reclaim callbacks, highest priority first */
+list_head_t mem_handlers;
+static uint32_t pm_reclaiming;
+static mem_handler_t zero_pool_mem_handler;
+pa_stats_t pa_stats;
+
+/* Low-end RAM frame reference counts, one per page table referencing
+   the frame. Zero for free frames and for the kernel image */
+uint16_t LowRamRefs[PM_LOW_PAGE_COUNT * 32];
+
 static void set_page_bit(uint32_t paddr) {
     uint32_t page_no = paddr >> 12; // (paddr / 4096)
     uint32_t bf_idx = page_no >> 5; // (page_no / 32)
@@ -59,6 +129,8 @@ static void set_page_bit(uint32_t paddr) {
     LowRamBitF[bf_idx] &= (~bit_mask);
     /* Decrement the free pages counter */
     LowRamFreeCount--;
+    if(LowRamFreeCount < pa_stats.ps_min_free)
+        pa_stats.ps_min_free = LowRamFreeCount;
 }
 
 static int tst_page_bit(uint32_t paddr) {
@@ -101,8 +173,13 @@ uint32_t pa_alloc() {
     uint32_t bitmask = 1, bit_no = 0;
     uint32_t paddr = 0;
     
-    if(LowRamFreeCount <= 0)
-        panic("out of memory.");
+    if(LowRamFreeCount <= pa_low_watermark)
+        mm_reclaim(LowRamFreeCount <= pa_min_watermark ? MEM_LEVEL_MIN : MEM_LEVEL_LOW);
+    if(LowRamFreeCount == 0) {
+        pa_stats.ps_failed++;
+        trace_event(TRACE_PA_ALLOC, 0);
+        return 0;
+    }
     /* Speed up the search by skipping full zones */
     while( LowRamBitF[idx] == 0 ) idx++;
     /* Now find the first free page in the field */
@@ -114,12 +191,223 @@ uint32_t pa_alloc() {
     paddr = ((idx * 32) + bit_no) << 12;
     /* Set the page as non-free and return */
     set_page_bit(paddr);
+    LowRamRefs[paddr >> 12] = 1;
+    pa_stats.ps_allocs++;
+    trace_event(TRACE_PA_ALLOC, paddr);
     return paddr;
 }
 
 void pa_free(uint32_t paddr) {
-    if(!tst_page_bit(paddr))
+    /* Frames above the managed area (device memory) are not ours */
+    if(paddr >= PM_MANAGED_LIMIT)
+        return;
+    LowRamRefs[paddr >> 12] = 0;
+    if(!tst_page_bit(paddr)) {
         clr_page_bit(paddr);
+        pa_stats.ps_frees++;
+    }
+}
+
+/* zero_frame(paddr) - clear a physical frame
+ *
+ * With SSE2 the stores are non-temporal, so zeroing frames nobody is
+ * going to read soon does not push the working set out of the cache.
+ */
+static void zero_frame(uint32_t paddr) {
+    uint32_t * dst = phys_to_virt(paddr);
+    uint32_t i;
+
+    if (!(cpu_features_edx & CPU_FEAT_SSE2)) {
+        asm volatile("rep stosl"
+                     : "+D" (dst), "=c" (i)
+                     : "a" (0), "1" (PAGE_SIZE / 4)
+                     : "memory");
+        return;
+    }
+    for (i = 0; i < PAGE_SIZE / 4; i += 4) {
+        asm volatile("movnti %1, 0(%0)\n"
+                     "movnti %1, 4(%0)\n"
+                     "movnti %1, 8(%0)\n"
+                     "movnti %1, 12(%0)\n"
+                     :: "r" (dst + i), "r" (0) : "memory");
+    }
+    asm volatile("sfence" ::: "memory");
+}
+
+/* pa_alloc_zeroed() - allocate a cleared frame
+ *
+ * Takes a frame from the pre-zeroed pool if there is one, otherwise
+ * allocates and clears it on the spot.
+ */
+uint32_t pa_alloc_zeroed() {
+    uint32_t paddr = 0, flags;
+
+    flags = intr_save();
+    if (ZeroPoolCount > 0)
+        paddr = ZeroPool[--ZeroPoolCount];
+    intr_restore(flags);
+    if (paddr != 0)
+        return paddr;
+
+    if ((paddr = pa_alloc()) != 0)
+        zero_frame(paddr);
+    return paddr;
+}
+
+/* pa_zero_pool_refill() - pre-zero one frame
+ *
+ * Called by the scheduler while no task is ready. Returns 0 once the
+ * pool is full, or free memory is too low to spend on it.
+ */
+uint32_t pa_zero_pool_refill() {
+    uint32_t paddr, flags;
+
+    // The idle loop runs with interrupts on, and interrupt handlers
+    // allocate too: only the clearing itself may be interrupted
+    flags = intr_save();
+    // Never push free memory towards the watermarks
+    if (ZeroPoolCount >= PM_ZERO_POOL_SIZE ||
+        LowRamFreeCount <= pa_low_watermark + PM_ZERO_POOL_SIZE ||
+        (paddr = pa_alloc()) == 0) {
+        intr_restore(flags);
+        return 0;
+    }
+    intr_restore(flags);
+
+    zero_frame(paddr);
+
+    flags = intr_save();
+    if (ZeroPoolCount < PM_ZERO_POOL_SIZE)
+        ZeroPool[ZeroPoolCount++] = paddr;
+    else
+        pa_free(paddr);
+    intr_restore(flags);
+    return 1;
+}
+
+/* The zero pool gives back half of its frames at MEM_LEVEL_LOW, and
+   all of them at MEM_LEVEL_MIN */
+static uint32_t zero_pool_handler(uint32_t level, void * data) {
+    uint32_t keep, flags;
+
+    (void) data;
+    flags = intr_save();
+    if (ZeroPoolCount == 0) {
+        intr_restore(flags);
+        return MEM_DID_NOTHING;
+    }
+    keep = (level == MEM_LEVEL_LOW) ? ZeroPoolCount / 2 : 0;
+    while (ZeroPoolCount > keep)
+        pa_free(ZeroPool[--ZeroPoolCount]);
+    intr_restore(flags);
+    return MEM_ALL_DONE;
+}
+
+/* add_mem_handler(handler), rem_mem_handler(handler)
+ *
+ * Memory handlers are called by priority when free memory drops under
+ * the low watermark, until it is back above it. They run inside the
+ * allocation that ran short, so they must not allocate or sleep. A
+ * handler returns MEM_TRY_AGAIN to be called again right away,
+ * MEM_ALL_DONE if it freed what it could, or MEM_DID_NOTHING.
+ */
+void add_mem_handler(mem_handler_t * handler) {
+    forbid();
+    enqueue(&mem_handlers, (list_node_t *) handler);
+    permit();
+}
+
+void rem_mem_handler(mem_handler_t * handler) {
+    forbid();
+    remove((list_node_t *) handler);
+    permit();
+}
+
+/* mm_reclaim(level) - run the memory handlers */
+void mm_reclaim(uint32_t level) {
+    mem_handler_t * handler;
+
+    // A handler freeing memory may end up in here again
+    if (pm_reclaiming)
+        return;
+    pm_reclaiming = 1;
+    forbid();
+    handler = (mem_handler_t *) get_head(&mem_handlers);
+    while (handler != NULL && LowRamFreeCount <= pa_low_watermark) {
+        if (handler->mh_code(level, handler->mh_data) != MEM_TRY_AGAIN)
+            handler = (mem_handler_t *) get_next((list_node_t *) handler);
+    }
+    permit();
+    pm_reclaiming = 0;
+}
+
+/* pa_alloc_contig(count, align, max_paddr) - allocate a frame run
+ *
+ * Finds count free frames in a row, starting on an align boundary
+ * (a power of two, at least PAGE_SIZE) and ending at or below
+ * max_paddr. Returns the physical address of the first one, or 0.
+ */
+uint32_t pa_alloc_contig(uint32_t count, uint32_t align, uint32_t max_paddr) {
+    uint32_t start, paddr, limit;
+    uint32_t tries;
+
+    if (count == 0)
+        return 0;
+    if (align < PAGE_SIZE)
+        align = PAGE_SIZE;
+    limit = (max_paddr < PM_MANAGED_LIMIT) ? max_paddr : PM_MANAGED_LIMIT;
+
+    // A second pass after the memory handlers had a go at it
+    for (tries = 0; tries < 2; tries++) {
+        forbid();
+        start = 0;      // Never free, page 0 is the real mode IVT and BDA
+        while (start + count * PAGE_SIZE <= limit) {
+            for (paddr = start; paddr < start + count * PAGE_SIZE; paddr += PAGE_SIZE)
+                if (!tst_page_bit(paddr))
+                    break;
+            if (paddr == start + count * PAGE_SIZE) {
+                for (paddr = start; paddr < start + count * PAGE_SIZE; paddr += PAGE_SIZE) {
+                    set_page_bit(paddr);
+                    LowRamRefs[paddr >> 12] = 1;
+                }
+                pa_stats.ps_allocs += count;
+                permit();
+                return start;
+            }
+            // Restart past the frame in use
+            start = (paddr + align) & ~(align - 1);
+        }
+        permit();
+        if (tries == 0)
+            mm_reclaim(MEM_LEVEL_MIN);
+    }
+    pa_stats.ps_failed++;
+    return 0;
+}
+
+/* pa_ref(paddr), pa_unref(paddr) - frame sharing
+ *
+ * pa_unref() releases the frame when the last reference goes away and
+ * returns how many references are left.
+ */
+void pa_ref(uint32_t paddr) {
+    if(paddr < PM_MANAGED_LIMIT)
+        LowRamRefs[paddr >> 12]++;
+}
+
+uint32_t pa_unref(uint32_t paddr) {
+    if(paddr >= PM_MANAGED_LIMIT)
+        return 0;
+    if(LowRamRefs[paddr >> 12] > 1)
+        return --LowRamRefs[paddr >> 12];
+    pa_free(paddr);
+    return 0;
+}
+
+uint32_t pa_refcount(uint32_t paddr) {
+    if(paddr >= PM_MANAGED_LIMIT)
+        return 0;
+    return LowRamRefs[paddr >> 12];
 }
 
 /* init_paging() - paging system bootstrap
@@ -132,46 +420,145 @@ void init_paging() {
     // Pointers to the page directory and the page table
 
     void *lowpagetablePtr = 0;
+    unsigned long physmaptablesPtr = 0;
     int k = 0;
 
+    // Kernel mappings are the same in every address space, so if
+    // possible keep them in the TLB when CR3 is reloaded
+    cpu_detect();
+    pm_global_flag = (cpu_features_edx & CPU_FEAT_PGE) ? PAGE_GLOBAL : 0;
+    pm_large_pages = (cpu_features_edx & CPU_FEAT_PSE) != 0;
+
     // Translate the page directory from
     // virtual address to physical address
     kernelpagedirPtr = (char *) kernelpagedir + 0x40000000;
     // Same for the page table
     lowpagetablePtr = (char *) lowpagetable + 0x40000000;
+    physmaptablesPtr = (unsigned long) physmaptables + 0x40000000;
 
     // Counts from 0 to 1023 to...
     for (k = 0; k < 1024; k++) {
         // ...map the first 4MB of memory into the page table...
-        lowpagetable[k] = (k * 4096) | 0x7;
+        lowpagetable[k] = (k * 4096) | 0x7 | pm_global_flag;
         // ...and clear the page directory entries
         kernelpagedir[k] = 0;
     }
 
     // Fills the addresses 0...4MB and 3072MB...3076MB
-    // of the page directory with the same page table
+    // of the page directory with the same page table. With PSE the
+    // kernel image gets a single 4 MiB page instead, and the page
+    // table only backs the low identity map (which loses page 0).
 
     kernelpagedir[0] = ((unsigned long) lowpagetablePtr) | 0x7;
-    kernelpagedir[768] = ((unsigned long) lowpagetablePtr) | 0x7;
+    if (pm_large_pages)
+        kernelpagedir[768] = 0x0 | PAGE_LARGE | pm_global_flag | 0x7;
+    else
+        kernelpagedir[768] = ((unsigned long) lowpagetablePtr) | 0x7;
+
+    // Map the managed RAM linearly at PHYS_MAP_BASE, so page tables
+    // and frames can be reached without mapping them first
+    for (k = 0; k < PM_PHYS_MAP_TABLES * 1024; k++) {
+        if (pm_large_pages) {
+            if ((k & 0x3FF) == 0)
+                kernelpagedir[PM_PHYS_MAP_PDE + (k >> 10)] =
+                    (k * 4096) | PAGE_LARGE | pm_global_flag | 0x7;
+            continue;
+        }
+        physmaptables[k >> 10][k & 0x3FF] = (k * 4096) | pm_global_flag | 0x7;
+        if ((k & 0x3FF) == 0)
+            kernelpagedir[PM_PHYS_MAP_PDE + (k >> 10)] =
+                (physmaptablesPtr + k * 4) | 0x7;
+    }
+    act_page_directory = kernelpagedirPtr;
 
-    // Self-reference the page directory for later easy access
-    kernelpagedir[1023] = ((unsigned long) kernelpagedirPtr) | 0x7;
+    if (pm_large_pages)
+        write_cr4(read_cr4() | CR4_PSE);
+    if (pm_global_flag)
+        write_cr4(read_cr4() | CR4_PGE);
 
     // Copies the address of the page directory into the CR3 register and,
-    // finally, enables paging!
+    // finally, enables paging! Write protection (WP) is enabled as well,
+    // so the kernel also faults on copy-on-write pages.
 
     asm volatile ( "mov %0, %%eax\n"
             "mov %%eax, %%cr3\n"
             "mov %%cr0, %%eax\n"
-            "orl $0x80000000, %%eax\n"
+            "orl $0x80010000, %%eax\n"
             "mov %%eax, %%cr0\n" ::"m" (kernelpagedirPtr));
 }
 
 void switch_page_directory(void *pagetabledir_ptr) {
+    act_page_directory = pagetabledir_ptr;
     asm volatile ( "mov %0, %%eax\n"
             "mov %%eax, %%cr3\n" ::"m" (pagetabledir_ptr));
 }
 
+/* sync_kernel_pde(pdindex) - pull a kernel directory entry
+ *
+ * Kernel page tables are shared by reference: every directory points
+ * at the same tables as kernelpagedir. Tables created after a directory
+ * was built are copied into it on first use. Returns non-zero if the
+ * entry is (now) present in the active directory.
+ */
+static int sync_kernel_pde(unsigned long pdindex) {
+    unsigned long * pd = PM_ACT_PD();
+
+    if (pd[pdindex] & PAGE_PRESENT)
+        return 1;
+    if (!IS_KERNEL_PDE(pdindex) || !(kernelpagedir[pdindex] & PAGE_PRESENT))
+        return 0;
+    pd[pdindex] = kernelpagedir[pdindex];
+    return 1;
+}
+
+/* create_address_space() - build a fresh page directory
+ *
+ * The new directory gets the kernel entries of kernelpagedir, so the
+ * kernel page tables are shared rather than copied, and an empty user
+ * area. Returns its physical address.
+ */
+pagedir_t * create_address_space() {
+    pagedir_t * pd_physical = (pagedir_t *) pa_alloc();
+    unsigned long * pd = phys_to_virt(pd_physical);
+    int i;
+
+    if (pd_physical == NULL)
+        return NULL;
+    for (i = 0; i < 1024; i++)
+        pd[i] = IS_KERNEL_PDE(i) ? kernelpagedir[i] : 0;
+
+    return pd_physical;
+}
+
+/* destroy_address_space(pd) - free a directory and its user mappings
+ *
+ * Drops one reference on every user page table; tables nobody else
+ * shares drop a reference on each frame they map. Must not be called
+ * on the active directory.
+ */
+void destroy_address_space(pagedir_t * pd_physical) {
+    unsigned long * pd = phys_to_virt(pd_physical);
+    unsigned long * pt;
+    unsigned long pt_physical;
+    int i, j;
+
+    for (i = 1; i < PM_KERNEL_FIRST_PDE; i++) {
+        if ((pd[i] & PAGE_PRESENT) == 0)
+            continue;
+        pt_physical = pd[i] & PAGE_MASK;
+        if (pa_refcount(pt_physical) > 1) {
+            pa_unref(pt_physical);
+            continue;
+        }
+        pt = phys_to_virt(pt_physical);
+        for (j = 0; j < 1024; j++)
+            if (pt[j] & PAGE_PRESENT)
+                pa_unref(pt[j] & PAGE_MASK);
+        pa_unref(pt_physical);
+    }
+    pa_free((uint32_t) pd_physical);
+}
+
 /* mm_init() - memory manager initialization function
  *
  * This calls init_paging to rudely map some space into the PD,
@@ -227,6 +614,16 @@ void mm_init(multiboot_t *mboot_ptr) {
     /* Set the kernel area as being used, and we're done */
     for(i = 0x100000; i < kernel_end; i += 0x1000)
         set_page_bit(i);
+    /* Count from here on, not the frames handed in above */
+    memset((uint8_t *) &pa_stats, 0, sizeof(pa_stats_t));
+    pa_stats.ps_min_free = LowRamFreeCount;
+
+    /* The zero pool is the cheapest thing to reclaim */
+    new_list(&mem_handlers);
+    strcpy(zero_pool_mem_handler.ln_link.name, "zero page pool");
+    zero_pool_mem_handler.ln_link.pri = 100;
+    zero_pool_mem_handler.mh_code = zero_pool_handler;
+    add_mem_handler(&zero_pool_mem_handler);
         
     mm_unmap(0x0);
 }
@@ -235,13 +632,16 @@ void * get_physaddr(void * virtualaddr) {
     unsigned long pdindex = (unsigned long) virtualaddr >> 22;
     unsigned long ptindex = (unsigned long) virtualaddr >> 12 & 0x03FF;
 
-    unsigned long * pd = (unsigned long *) 0xFFFFF000;
     // Here you need to check whether the PD entry is present.
     // If the page table isn't present, return null
-    if ((pd[pdindex] & 0x01) == 0)
+    if (!sync_kernel_pde(pdindex))
         return NULL;
 
-    unsigned long * pt = ((unsigned long *) 0xFFC00000) + (0x400 * pdindex);
+    unsigned long * pd = PM_ACT_PD();
+    if (pd[pdindex] & PAGE_LARGE)
+        return (void *) ((pd[pdindex] & LARGE_PAGE_MASK) + ((unsigned long) virtualaddr & ~LARGE_PAGE_MASK));
+
+    unsigned long * pt = PM_PDE_TABLE(pd[pdindex]);
     // Here you need to check whether the PT entry is present.
     // If the page isn't present, return null
     if ((pt[ptindex] & 0x01) == 0)
@@ -274,26 +674,42 @@ void * mm_map(void * physaddr, void * virtualaddr, unsigned int flags) {
     unsigned long pdindex = (unsigned long) virtualaddr >> 22;
     unsigned long ptindex = ((unsigned long) virtualaddr >> 12) & 0x03FF;
     unsigned long * pt;
+    unsigned long pt_physical;
 
     if (physaddr == NULL)
         return 0;
 
-    unsigned long * pd = (unsigned long *) 0xFFFFF000;
+    unsigned long * pd = PM_ACT_PD();
     // Here you need to check whether the PD entry is present.
     // When it is not present, you need to create a new empty PT and
     // adjust the PDE accordingly.
 
-    if ((pd[pdindex] & 0x01) == 0){ // If the page table isn't present, add one
-        pd[pdindex] = pa_alloc() | (flags & 0xFFF) | 0x01;
-        // zero out the page table
-        pt = ((unsigned long *) 0xFFC00000) + 0x400 * pdindex;
-        memset(pt, 0, 4096);
+    if (!sync_kernel_pde(pdindex)){ // If the page table isn't present, add an empty one
+        if ((pt_physical = pa_alloc_zeroed()) == 0)
+            return 0;
+        pd[pdindex] = pt_physical | (flags & 0xFFF) | 0x01;
+        // Kernel tables go to the master directory too, so that
+        // every address space can share them
+        if (IS_KERNEL_PDE(pdindex))
+            kernelpagedir[pdindex] = pd[pdindex];
     }
 
-    pt = ((unsigned long *) 0xFFC00000) + 0x400 * pdindex; // 0x400 ??
+    // Large pages are shared by every address space, they can't be
+    // split behind the other directories' back
+    if (pd[pdindex] & PAGE_LARGE)
+        return 0;
+
+    // A table shared with another address space must be split
+    // before this one can change it
+    if ((pd[pdindex] & PAGE_COW) && !unshare_page_table(pdindex))
+        return 0;
+
+    pt = PM_PDE_TABLE(pd[pdindex]);
     // Here you need to check whether the PT entry is present.
     // When it is, then there is already a mapping present. What do you do now?
     pt[ptindex] = ((unsigned long) physaddr) | (flags & 0xFFF) | 0x01; // Present
+    if (IS_KERNEL_PDE(pdindex))
+        pt[ptindex] |= pm_global_flag;
 
     // Now you need to flush the entry in the TLB
     // to validate the change.
@@ -307,9 +723,15 @@ void mm_unmap(void * virtualaddr) {
 
     unsigned long pdindex = (unsigned long) virtualaddr >> 22;
     unsigned long ptindex = ((unsigned long) virtualaddr >> 12) & 0x03FF;
+    unsigned long * pd = PM_ACT_PD();
     unsigned long * pt;
     
-    pt = ((unsigned long *) 0xFFC00000) + 0x400 * pdindex; // 0x400 ??
+    if (!sync_kernel_pde(pdindex) || (pd[pdindex] & PAGE_LARGE))
+        return;
+    if ((pd[pdindex] & PAGE_COW) && !unshare_page_table(pdindex))
+        return;
+    
+    pt = PM_PDE_TABLE(pd[pdindex]);
     // Set the page table entry to 0
     pt[ptindex] = 0;
 
@@ -319,11 +741,255 @@ void mm_unmap(void * virtualaddr) {
     flush_tlb((unsigned long) virtualaddr);
 }
 
+/* Invalidations gathered by a range operation */
+typedef struct {
+    uint32_t start, end;            // Range touched so far
+    uint32_t count;                 // Pages in pages[], or past the limit
+    uint32_t global;                // Some of them were global
+    uint32_t pages[PM_TLB_BATCH_MAX];
+} tlb_batch_t;
+
+static void tlb_batch_add(tlb_batch_t * batch, uint32_t va, unsigned long pte) {
+    if (batch->count == 0 || va < batch->start)
+        batch->start = va;
+    if (va + PAGE_SIZE > batch->end)
+        batch->end = va + PAGE_SIZE;
+    if (batch->count < PM_TLB_BATCH_MAX)
+        batch->pages[batch->count] = va;
+    batch->count++;
+    if (pte & PAGE_GLOBAL)
+        batch->global = 1;
+}
+
+static void tlb_batch_flush(tlb_batch_t * batch) {
+    uint32_t i;
+
+    if (batch->count == 0)
+        return;
+    if (batch->count > tlb_flush_threshold || batch->count > PM_TLB_BATCH_MAX) {
+        if (batch->global)
+            flush_tlb_global();
+        else
+            flush_tlb_all();
+    }
+    else {
+        for (i = 0; i < batch->count; i++)
+            flush_tlb(batch->pages[i]);
+    }
+    if (tlb_shootdown_hook != NULL)
+        tlb_shootdown_hook(batch->start, batch->end);
+    batch->count = 0;
+}
+
+/* range_table(va, pd) - page table to work on for a range operation
+ *
+ * Returns NULL if there is nothing mapped with 4 KiB pages in the
+ * directory entry of va. Copy-on-write tables are split first.
+ */
+static unsigned long * range_table(unsigned long * pd, unsigned long va) {
+    unsigned long pdindex = va >> 22;
+
+    if (!sync_kernel_pde(pdindex) || (pd[pdindex] & PAGE_LARGE))
+        return NULL;
+    if ((pd[pdindex] & PAGE_COW) && !unshare_page_table(pdindex))
+        return NULL;
+    return PM_PDE_TABLE(pd[pdindex]);
+}
+
+/* Last byte of a range in *last. Returns 0 if the range is empty or
+   runs past 4 GiB */
+static int range_last(void * virtualaddr, uint32_t size, unsigned long * last) {
+    if (size == 0 || size - 1 > ~(unsigned long) virtualaddr)
+        return 0;
+    *last = (unsigned long) virtualaddr + size - 1;
+    return 1;
+}
+
+/* mm_unmap_range(virt, size, flags) - unmap a range of pages
+ *
+ * With MM_UNMAP_FREE, the reference on each frame is dropped as well.
+ * The TLB is flushed once at the end. Large pages are left alone, and
+ * so is a range that runs past 4 GiB.
+ */
+void mm_unmap_range(void * virtualaddr, uint32_t size, unsigned int flags) {
+    unsigned long va = (unsigned long) virtualaddr & PAGE_MASK;
+    unsigned long last;
+    unsigned long * pd = PM_ACT_PD();
+    unsigned long * pt;
+    unsigned long pte;
+    tlb_batch_t batch;
+
+    if (!range_last(virtualaddr, size, &last))
+        return;
+    batch.count = 0;
+    batch.global = 0;
+    while (va <= last) {
+        if ((pt = range_table(pd, va)) == NULL) {
+            va = (va & LARGE_PAGE_MASK) + LARGE_PAGE_SIZE;
+            if (va == 0)
+                break;
+            continue;
+        }
+        pte = pt[(va >> 12) & 0x3FF];
+        if (pte & PAGE_PRESENT) {
+            pt[(va >> 12) & 0x3FF] = 0;
+            if (flags & MM_UNMAP_FREE)
+                pa_unref(pte & PAGE_MASK);
+            tlb_batch_add(&batch, va, pte);
+        }
+        va += PAGE_SIZE;
+        if (va == 0)
+            break;
+    }
+    tlb_batch_flush(&batch);
+}
+
+/* mm_protect_range(virt, size, flags) - change page protections
+ *
+ * Sets PAGE_WRITE and PAGE_USER of every mapped page in the range as
+ * given in flags. Frames still shared with another address space are
+ * made copy-on-write instead of writable. A range that runs past 4 GiB
+ * is left alone.
+ */
+void mm_protect_range(void * virtualaddr, uint32_t size, unsigned int flags) {
+    unsigned long va = (unsigned long) virtualaddr & PAGE_MASK;
+    unsigned long last;
+    unsigned long * pd = PM_ACT_PD();
+    unsigned long * pt;
+    unsigned long pte, new_pte;
+    tlb_batch_t batch;
+
+    if (!range_last(virtualaddr, size, &last))
+        return;
+    batch.count = 0;
+    batch.global = 0;
+    while (va <= last) {
+        if ((pt = range_table(pd, va)) == NULL) {
+            va = (va & LARGE_PAGE_MASK) + LARGE_PAGE_SIZE;
+            if (va == 0)
+                break;
+            continue;
+        }
+        pte = pt[(va >> 12) & 0x3FF];
+        if (pte & PAGE_PRESENT) {
+            new_pte = (pte & ~(PAGE_WRITE | PAGE_USER | PAGE_COW)) |
+                      (flags & PAGE_USER);
+            if (flags & PAGE_WRITE)
+                new_pte |= pa_refcount(pte & PAGE_MASK) > 1 ? PAGE_COW : PAGE_WRITE;
+            if (new_pte != pte) {
+                pt[(va >> 12) & 0x3FF] = new_pte;
+                tlb_batch_add(&batch, va, pte);
+            }
+        }
+        va += PAGE_SIZE;
+        if (va == 0)
+            break;
+    }
+    tlb_batch_flush(&batch);
+}
+
+/* mm_map_large(phys, virt, flags) - map a single 4 MiB page
+ *
+ * Only for the kernel part of the address space, where the entry is
+ * shared with every directory. Both addresses must be 4 MiB aligned
+ * and the slot must be empty. Returns NULL if any of this fails or
+ * the CPU has no PSE.
+ */
+void * mm_map_large(void * physaddr, void * virtualaddr, unsigned int flags) {
+    unsigned long pdindex = (unsigned long) virtualaddr >> 22;
+    unsigned long * pd = PM_ACT_PD();
+
+    if (!pm_large_pages || !IS_KERNEL_PDE(pdindex))
+        return NULL;
+    if (((unsigned long) physaddr | (unsigned long) virtualaddr) & ~LARGE_PAGE_MASK)
+        return NULL;
+    if (sync_kernel_pde(pdindex))
+        return NULL;
+
+    pd[pdindex] = ((unsigned long) physaddr) | (flags & 0xFFF) |
+                  PAGE_LARGE | pm_global_flag | 0x01;
+    kernelpagedir[pdindex] = pd[pdindex];
+    flush_tlb((unsigned long) virtualaddr);
+
+    return virtualaddr;
+}
+
+/* Undo the part of a failed mm_map_range() in [start, end). Any large
+   page in there was made by it: mm_map_large() only takes empty slots */
+static void unmap_partial(unsigned long start, unsigned long end) {
+    unsigned long * pd = PM_ACT_PD();
+    unsigned long pdindex;
+    int large = 0;
+
+    if (end == start)
+        return;
+    for (pdindex = start >> 22; pdindex <= (end - 1) >> 22; pdindex++) {
+        if (pd[pdindex] & PAGE_LARGE) {
+            pd[pdindex] = 0;
+            kernelpagedir[pdindex] = 0;
+            large = 1;
+        }
+    }
+    if (large)
+        flush_tlb_global();
+    mm_unmap_range((void *) start, end - start, 0);
+}
+
+/* mm_map_range(phys, virt, size, flags) - map a contiguous range
+ *
+ * Every 4 MiB stretch that is aligned on both sides and still unmapped
+ * is promoted to a large page, the rest is mapped page by page.
+ * Returns virt, or NULL if a mapping could not be made, in which case
+ * nothing of the range is left mapped.
+ */
+void * mm_map_range(void * physaddr, void * virtualaddr, uint32_t size, unsigned int flags) {
+    unsigned long phys = (unsigned long) physaddr & PAGE_MASK;
+    unsigned long start = (unsigned long) virtualaddr & PAGE_MASK;
+    unsigned long virt = start;
+    unsigned long last;
+
+    if (!range_last(virtualaddr, size, &last))
+        return NULL;
+    while (virt <= last) {
+        if (last - virt >= LARGE_PAGE_SIZE - 1 &&
+            mm_map_large((void *) phys, (void *) virt, flags) != NULL) {
+            phys += LARGE_PAGE_SIZE;
+            virt += LARGE_PAGE_SIZE;
+        }
+        else if (mm_map((void *) phys, (void *) virt, flags) != NULL) {
+            phys += PAGE_SIZE;
+            virt += PAGE_SIZE;
+        }
+        else {
+            unmap_partial(start, virt);
+            return NULL;
+        }
+        if (virt == 0)
+            break;
+    }
+    return virtualaddr;
+}
+
 static void page_fault(registers_t *regs) {
     uint32_t cr2;
+    unsigned long * pd = PM_ACT_PD();
     asm volatile ("mov %%cr2, %0" : "=r" (cr2));
 
-    kprintf("\nPage fault at 0x%x, faulting address 0x%x\n", regs->eip, cr2);
+    // A kernel page table created after this address space was
+    // built: link it in and retry
+    if ((pd[cr2 >> 22] & PAGE_PRESENT) == 0 && sync_kernel_pde(cr2 >> 22))
+        return;
+
+    // A write to a page shared by clone_actual_directory()
+    if ((regs->err_code & (PAGE_PRESENT | PAGE_WRITE)) == (PAGE_PRESENT | PAGE_WRITE) &&
+        cow_fault(cr2))
+        return;
+
+    // First touch of a reserved region
+    if ((regs->err_code & PAGE_PRESENT) == 0 && demand_fault(cr2))
+        return;
+
+    klog(LOG_SYS_MM, LOG_EMERG, "page fault at 0x%x, faulting address 0x%x\n", regs->eip, cr2);
     kprintf("CPU error code: %x\n", regs->err_code);
     
     //kprintf("OOPS: %s crashed at 0x%x!!\n", sys_base->running_thread->node.name, regs->eip);
@@ -335,35 +1001,246 @@ static void page_fault(registers_t *regs) {
     for (;;);
 }
 
-// Clones the current page directory
-// Returns the physycal address of the new directory
+/* unshare_page_table(pdindex) - split a copy-on-write page table
+ *
+ * The last user simply gets write access back. Otherwise this address
+ * space gets a private copy of the table: the frames it maps become
+ * shared between both tables, so they turn copy-on-write themselves.
+ */
+static int unshare_page_table(unsigned long pdindex) {
+    unsigned long * pd = PM_ACT_PD();
+    unsigned long * pt = PM_PDE_TABLE(pd[pdindex]);
+    unsigned long * copy;
+    unsigned long old_pt = pd[pdindex] & PAGE_MASK;
+    unsigned long new_pt;
+    int i;
+
+    if (pa_refcount(old_pt) > 1) {
+        if ((new_pt = pa_alloc()) == 0)
+            return 0;
+        copy = phys_to_virt(new_pt);
+        for (i = 0; i < 1024; i++) {
+            if ((pt[i] & PAGE_PRESENT) && pt[i] < PM_MANAGED_LIMIT) {
+                if (pt[i] & PAGE_WRITE)
+                    pt[i] = (pt[i] & ~PAGE_WRITE) | PAGE_COW;
+                pa_ref(pt[i] & PAGE_MASK);
+            }
+            copy[i] = pt[i];
+        }
+        pa_unref(old_pt);
+        pd[pdindex] = new_pt | (pd[pdindex] & 0xFFF);
+    }
+    pd[pdindex] = (pd[pdindex] & ~PAGE_COW) | PAGE_WRITE;
+    flush_tlb_all();
+    return 1;
+}
+
+/* cow_fault(addr) - resolve a write to a copy-on-write page
+ *
+ * Returns non-zero if the page is writable now and the faulting
+ * instruction can be restarted.
+ */
+static int cow_fault(unsigned long addr) {
+    unsigned long pdindex = addr >> 22;
+    unsigned long ptindex = (addr >> 12) & 0x03FF;
+    unsigned long * pd = PM_ACT_PD();
+    unsigned long * pt;
+    unsigned long old_page, new_page;
+
+    if (IS_KERNEL_PDE(pdindex))
+        return 0;
+    if ((pd[pdindex] & PAGE_COW) && !unshare_page_table(pdindex))
+        return 0;
+    pt = PM_PDE_TABLE(pd[pdindex]);
+    if ((pt[ptindex] & PAGE_COW) == 0)
+        return 0;
+
+    addr &= PAGE_MASK;
+    old_page = pt[ptindex] & PAGE_MASK;
+    if (pa_refcount(old_page) > 1) {
+        if ((new_page = pa_alloc()) == 0)
+            return 0;
+        memcpy(phys_to_virt(new_page), (uint8_t *) addr, PAGE_SIZE);
+        pa_unref(old_page);
+        pt[ptindex] = new_page | (pt[ptindex] & 0xFFF);
+    }
+    pt[ptindex] = (pt[ptindex] & ~PAGE_COW) | PAGE_WRITE;
+    flush_tlb(addr);
+    return 1;
+}
+
+/* clone_actual_directory() - copy-on-write clone of the address space
+ *
+ * The user page tables are shared read-only between both directories
+ * and only copied, then page by page, when either side writes to them.
+ * Returns the physical address of the new directory.
+ */
 pagedir_t * clone_actual_directory(){
-    unsigned long * source_pd = (unsigned long *) 0xFFFFF000;
+    unsigned long * source_pd = PM_ACT_PD();
     unsigned long * dest_pd;
-    pagedir_t * dest_pd_physical = pa_alloc();
-    pagetable_t * dest_pt_physical;
-    unsigned long * pt;
+    pagedir_t * dest_pd_physical = create_address_space();
     int i;
-    // Copy first the page directory
-    dest_pd = mm_map(dest_pd_physical, PM_DIR_CLONE_ADDR, PAGE_WRITE);
-    memcpy(PM_DIR_CLONE_ADDR, source_pd, 4096);
-    // Now iterate over each one of the page tables
-    // and copy those who exist
-    for(i = 0; i < 1024; i++){
-        pt = ((unsigned long *) 0xFFC00000) + (0x400 * i);
-        if (pt != 0){
-            dest_pt_physical = pa_alloc();
-            mm_map(dest_pt_physical, PM_DIR_CLONE_ADDR, PAGE_WRITE);
-            memcpy(PM_DIR_CLONE_ADDR, ((unsigned long)pt & PAGE_MASK), 4096);
-            // Point the directory entry to the new page 
-            // with the same permitions
-            dest_pd[i] = ((unsigned long)pt & 0x7) |
-                    (unsigned long)dest_pt_physical;
-        }
+
+    if (dest_pd_physical == NULL)
+        return NULL;
+
+    dest_pd = phys_to_virt(dest_pd_physical);
+    // The stack zone is private, the clone gets its own stack
+    for (i = 1; i < PM_STACK_PDE; i++) {
+        if ((source_pd[i] & PAGE_PRESENT) == 0)
+            continue;
+        source_pd[i] = (source_pd[i] & ~PAGE_WRITE) | PAGE_COW;
+        dest_pd[i] = source_pd[i];
+        pa_ref(source_pd[i] & PAGE_MASK);
     }
+    // Our own entries went read-only
+    flush_tlb_all();
     return dest_pd_physical;
 }
 
+/* find_region(regions, addr) - region list lookup */
+static vm_region_t * find_region(list_head_t * regions, uint32_t addr) {
+    vm_region_t * region = (vm_region_t *) get_head(regions);
+
+    while (region != NULL && region->start <= addr) {
+        if (addr < region->end)
+            return region;
+        region = (vm_region_t *) get_next((list_node_t *) region);
+    }
+    return NULL;
+}
+
+/* demand_fault(addr) - populate a reserved page on first touch
+ *
+ * The page gets a zeroed frame. A fault in the stack zone outside the
+ * stack region hit the guard page below it, i.e. the stack overflowed.
+ */
+static int demand_fault(unsigned long addr) {
+    vm_region_t * region;
+    unsigned long frame;
+
+    if (running_task == NULL || addr >= MM_STACK_TOP)
+        return 0;
+
+    region = find_region(&running_task->vm_regions, addr);
+    if (region == NULL) {
+        if (addr >= MM_STACK_ZONE)
+            klog(LOG_SYS_MM, LOG_ERR, "stack overflow in %s\n", running_task->ln_link.name);
+        return 0;
+    }
+
+    if ((frame = pa_alloc_zeroed()) == 0)
+        return 0;
+    // No page table for it: report the fault rather than retrying forever
+    if (mm_map((void *) frame, (void *) (addr & PAGE_MASK), region->flags) == NULL) {
+        pa_free(frame);
+        return 0;
+    }
+    return 1;
+}
+
+/* mm_reserve(regions, start, size, flags) - reserve a virtual range
+ *
+ * Nothing gets mapped now: the page fault handler maps each page with
+ * the given flags when it is first touched.
+ */
+vm_region_t * mm_reserve(list_head_t * regions, uint32_t start, uint32_t size, unsigned int flags) {
+    vm_region_t * region = (vm_region_t *) kmalloc(sizeof(vm_region_t));
+    vm_region_t * aux = (vm_region_t *) get_head(regions);
+
+    if (region == NULL)
+        return NULL;
+
+    region->start = start & PAGE_MASK;
+    region->end = (start + size + PAGE_SIZE - 1) & PAGE_MASK;
+    region->flags = flags;
+
+    // Keep the list sorted by address
+    while (aux != NULL && aux->start < region->start)
+        aux = (vm_region_t *) get_next((list_node_t *) aux);
+    if (aux == NULL) {
+        add_tail(regions, (list_node_t *) region);
+    }
+    else {
+        region->mn_link.next = (list_node_t *) aux;
+        region->mn_link.prev = aux->mn_link.prev;
+        aux->mn_link.prev->next = (list_node_t *) region;
+        aux->mn_link.prev = (list_node_t *) region;
+    }
+    return region;
+}
+
+/* mm_alloc_anon(regions, size) - reserve an anonymous range
+ *
+ * Takes the first gap above MM_ANON_BASE, keeping an unmapped page
+ * between regions. Returns the start address, or NULL.
+ */
+void * mm_alloc_anon(list_head_t * regions, uint32_t size) {
+    vm_region_t * region = (vm_region_t *) get_head(regions);
+    uint32_t addr = MM_ANON_BASE;
+
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    if (size == 0 || size > MM_STACK_ZONE - MM_ANON_BASE)
+        return NULL;
+
+    while (region != NULL) {
+        if (region->end + PAGE_SIZE > addr) {
+            if (region->start >= addr + size + PAGE_SIZE)
+                break;
+            addr = region->end + PAGE_SIZE;
+        }
+        region = (vm_region_t *) get_next((list_node_t *) region);
+    }
+    if (addr > MM_STACK_ZONE - size)
+        return NULL;
+    if (mm_reserve(regions, addr, size, PAGE_WRITE | PAGE_USER) == NULL)
+        return NULL;
+    return (void *) addr;
+}
+
+/* mm_unreserve(regions, start) - drop a region of the active space
+ *
+ * Pages already populated are unmapped and their frames released.
+ */
+void mm_unreserve(list_head_t * regions, uint32_t start) {
+    vm_region_t * region = find_region(regions, start);
+
+    if (region == NULL)
+        return;
+    mm_unmap_range((void *) region->start, region->end - region->start, MM_UNMAP_FREE);
+    remove((list_node_t *) region);
+    kfree(region);
+}
+
+/* mm_clone_regions(dest, src) - inherit regions in a cloned space
+ *
+ * Stack regions are left out, as the stack zone is never cloned.
+ * Returns 0 if memory ran out half way.
+ */
+int mm_clone_regions(list_head_t * dest, list_head_t * src) {
+    vm_region_t * region = (vm_region_t *) get_head(src);
+
+    while (region != NULL && region->start < MM_STACK_ZONE) {
+        if (mm_reserve(dest, region->start, region->end - region->start, region->flags) == NULL)
+            return 0;
+        region = (vm_region_t *) get_next((list_node_t *) region);
+    }
+    return 1;
+}
+
+/* mm_release_regions(regions) - forget every region of a task
+ *
+ * The frames themselves go away with destroy_address_space().
+ */
+void mm_release_regions(list_head_t * regions) {
+    list_node_t * region;
+
+    while ((region = get_head(regions)) != NULL) {
+        remove(region);
+        kfree(region);
+    }
+}
+
 /* flush_tlb(virtualaddr) - TLB entry invalidation function
  *
  * Came directly from the Linux kernel
@@ -372,4 +1249,26 @@ static inline void flush_tlb(unsigned long virtualaddr) {
     asm volatile("invlpg (%0)" ::"r" (virtualaddr) : "memory");
 }
 
+/* flush_tlb_all() - drop every non-global TLB entry */
+static inline void flush_tlb_all() {
+    asm volatile("mov %%cr3, %%eax\n"
+                 "mov %%eax, %%cr3\n" ::: "eax", "memory");
+}
+
+/* flush_tlb_global() - drop every TLB entry, kernel ones included
+ *
+ * Toggling CR4.PGE is the only way to evict global entries in bulk.
+ */
+static inline void flush_tlb_global() {
+    uint32_t cr4;
+
+    if (!pm_global_flag) {
+        flush_tlb_all();
+        return;
+    }
+    cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+}
+
 
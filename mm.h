@@ -15,26 +15,134 @@
 #define PAGE_PRESENT   0x1        // Page is mapped in.
 #define PAGE_WRITE     0x2        // Page is writable. Not set means read-only.
 #define PAGE_USER      0x4        // Page is writable from user space. Unset means kernel-only.
+#define PAGE_LARGE     0x80       // Directory entry maps a 4 MiB page (PSE).
+#define PAGE_GLOBAL    0x100      // Kept in the TLB across CR3 loads.
+#define PAGE_COW       0x200      // Write-protected only because it is shared (OS bit).
 #define PAGE_MASK      0xFFFFF000 // Mask constant to page-align an address.
 #define PAGE_SIZE	   4096
+#define LARGE_PAGE_SIZE 0x400000
+#define LARGE_PAGE_MASK 0xFFC00000
+
+#define MM_ANON_BASE   0x40000000 // Anonymous regions are placed from here up.
+#define MM_STACK_ZONE  0xBFC00000 // Last user 4 MiB, private to each task for its stack.
+#define MM_STACK_TOP   0xC0000000 // Initial stack pointer of every task.
+#define PHYS_MAP_BASE  0xD0000000 // Physical RAM is mapped linearly from here...
+#define PHYS_MAP_SIZE  0x01000000 // ...up to the end of the managed low RAM.
+
+#define MM_UNMAP_FREE  0x1        // mm_unmap_range(): also release the frames.
+
+/* Kernel address of a physical frame below PHYS_MAP_SIZE */
+#define phys_to_virt(paddr) ((void *) ((unsigned long) (paddr) + PHYS_MAP_BASE))
 
 typedef unsigned long pagedir_t;
 typedef unsigned long pagetable_t;
 
+/* A reserved virtual range, populated page by page on first touch */
+struct vm_region_s {
+    min_node_t mn_link;     // Link in the task region list, sorted by address
+    uint32_t start;
+    uint32_t end;           // First address past the region
+    uint32_t flags;         // PAGE_xxx flags of the pages mapped in
+};
+
+typedef struct vm_region_s vm_region_t;
+
+/* Memory pressure levels passed to the memory handlers */
+#define MEM_LEVEL_LOW    1      // Under pa_low_watermark, free what is cheap
+#define MEM_LEVEL_MIN    2      // Under pa_min_watermark, free all you can
+
+/* Memory handler results */
+#define MEM_DID_NOTHING  0
+#define MEM_ALL_DONE     1
+#define MEM_TRY_AGAIN    2
+
+/* A reclaim callback, called under memory pressure */
+struct mem_handler_s {
+    list_node_t ln_link;    // Priority sets the calling order
+    uint32_t (*mh_code)(uint32_t level, void * data);
+    void * mh_data;
+};
+
+typedef struct mem_handler_s mem_handler_t;
+
+/* Frame allocator counters, since boot */
+struct pa_stats_s {
+    uint32_t ps_allocs;     // Frames handed out, contiguous ones included
+    uint32_t ps_frees;      // Frames given back
+    uint32_t ps_failed;     // Allocations that found nothing
+    uint32_t ps_min_free;   // Low watermark of LowRamFreeCount
+};
+
+typedef struct pa_stats_s pa_stats_t;
+
+extern pa_stats_t pa_stats;
+
 void mm_init(multiboot_t * mboot);
 
 unsigned int pa_alloc();
 
+unsigned int pa_alloc_zeroed();
+
+unsigned int pa_alloc_contig(unsigned int count, unsigned int align, unsigned int max_paddr);
+
+unsigned int pa_zero_pool_refill();
+
 void pa_free(unsigned int page);
 
+void add_mem_handler(mem_handler_t * handler);
+
+void rem_mem_handler(mem_handler_t * handler);
+
+void mm_reclaim(uint32_t level);
+
+extern uint32_t pa_low_watermark;
+
+extern uint32_t pa_min_watermark;
+
+void pa_ref(unsigned int page);
+
+unsigned int pa_unref(unsigned int page);
+
+unsigned int pa_refcount(unsigned int page);
+
 void * get_physaddr(void * virtualaddr);
 
 void * mm_map(void * physaddr, void * virtualaddr, unsigned int flags);
 
 void mm_unmap(void * virtualaddr);
 
+void mm_unmap_range(void * virtualaddr, uint32_t size, unsigned int flags);
+
+void mm_protect_range(void * virtualaddr, uint32_t size, unsigned int flags);
+
+extern uint32_t tlb_flush_threshold;
+
+extern void (*tlb_shootdown_hook)(uint32_t start, uint32_t end);
+
+void * mm_map_large(void * physaddr, void * virtualaddr, unsigned int flags);
+
+void * mm_map_range(void * physaddr, void * virtualaddr, uint32_t size, unsigned int flags);
+
 void switch_page_directory(void *pagetabledir_ptr);
 
+pagedir_t * create_address_space();
+
+void destroy_address_space(pagedir_t * pd_physical);
+
+pagedir_t * clone_actual_directory();
+
+vm_region_t * mm_reserve(list_head_t * regions, uint32_t start, uint32_t size, unsigned int flags);
+
+void * mm_alloc_anon(list_head_t * regions, uint32_t size);
+
+void mm_unreserve(list_head_t * regions, uint32_t start);
+
+int mm_clone_regions(list_head_t * dest, list_head_t * src);
+
+void mm_release_regions(list_head_t * regions);
+
+extern pagedir_t * act_page_directory;
+
 void * dos_mm_map(void * physaddr, void * virtualaddr, unsigned int flags);
 
 void dos_mm_unmap(void * virtualaddr);
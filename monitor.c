@@ -5,6 +5,7 @@
 #include "monitor.h"
 #include "pmm.h"
 #include "common.h"
+#include "cpu.h"
 
 uint16_t *video_memory = (uint16_t*) 0xB8000;
 
@@ -12,6 +13,22 @@ uint16_t *video_memory = (uint16_t*) 0xB8000;
 uint32_t cursor_x = 0;
 uint32_t cursor_y = 0;
 
+// Text goes to a RAM copy of the 24 scrolling rows and only reaches
+// video memory, which is slow to touch and slower to read, when a
+// write is flushed. The copy is a ring of lines: scrolling moves
+// top_line instead of moving text. Row 24 is the status line, written
+// straight to video memory by monitor_writexy().
+#define TEXT_ROWS   24
+#define TEXT_COLS   80
+
+static uint16_t shadow[TEXT_ROWS][TEXT_COLS];
+static uint32_t top_line;       // Ring line shown on screen row 0
+static uint32_t dirty_rows;     // Screen rows to copy out, one bit each
+static uint32_t shadow_gen;     // Bumped on every change to the copy
+static uint32_t hw_cursor = 0xFFFFFFFF;
+
+#define ROW(y)      shadow[(top_line + (y)) % TEXT_ROWS]
+
  /* void update_cursor(int row, int col)
   * by Dark Fiber
   */
@@ -19,6 +36,10 @@ void update_cursor(int row, int col)
 {
    unsigned short position=(row*80) + col;
 
+   // Skip the port writes if the cursor did not move
+   if (position == hw_cursor)
+       return;
+   hw_cursor = position;
    // cursor LOW port to vga INDEX register
    outb(0x3D4, 0x0F);
    outb(0x3D5, (unsigned char)(position&0xFF));
@@ -27,45 +48,83 @@ void update_cursor(int row, int col)
    outb(0x3D5, (unsigned char )((position>>8)&0xFF));
 }
 
+// Copy the dirty rows out to video memory and place the cursor.
+// Writers only keep interrupts off while they change the copy: the
+// rows are copied out with interrupts on, and copied again if the copy
+// changed meanwhile, as an older value may have been stored over a
+// newer one.
+
+static void flush() {
+    uint32_t y, x, rows, gen, flags;
+    uint16_t * src, * dst;
+
+    flags = intr_save();
+    while (dirty_rows != 0) {
+        rows = dirty_rows;
+        dirty_rows = 0;
+        gen = shadow_gen;
+        intr_restore(flags);
+
+        for (y = 0; rows >> y != 0; y++) {
+            if (!(rows & (1 << y)))
+                continue;
+            src = ROW(y);
+            dst = video_memory + y * TEXT_COLS;
+            for (x = 0; x < TEXT_COLS; x++)
+                dst[x] = src[x];
+        }
+
+        flags = intr_save();
+        if (shadow_gen != gen)
+            dirty_rows |= rows;
+    }
+    update_cursor(cursor_y, cursor_x);
+    intr_restore(flags);
+}
+
 // Scrolls the text on the screen up by one line.
 
 static void scroll() {
     // Get a space character with the default colour attributes.
     uint8_t attributeByte = (0 /*black*/ << 4) | (15 /*white*/ & 0x0F);
     uint16_t blank = 0x20 /* space */ | (attributeByte << 8);
-
-    if (cursor_y >= 24) {
-        // Move the current text chunk that makes up the screen
-        // back in the buffer by a line
-        int i;
-        for (i = 0; i < 80*23; i++)
-            video_memory[i] = video_memory[80 + i];
-
-        // The last line should now be blank. Do this by writing
-        // 80 spaces to it.
-        for (i = 80*23;
-             i < 80*24; i++)
-            video_memory[i] = blank;
-
-        // The cursor should now be on the last line.
-        cursor_y = 23;
+    uint32_t x;
+
+    while (cursor_y >= TEXT_ROWS) {
+        // The old top line becomes the new, blank, bottom line
+        top_line = (top_line + 1) % TEXT_ROWS;
+        for (x = 0; x < TEXT_COLS; x++)
+            ROW(TEXT_ROWS - 1)[x] = blank;
+        // Every row on screen shows a different line now
+        dirty_rows = (1 << TEXT_ROWS) - 1;
+        cursor_y--;
     }
-    update_cursor(cursor_y, cursor_x);
 }
 
 void monitor_writexy(int x, int y, char * txt, uint8_t backColour, uint8_t foreColour)
 {
     uint8_t attributeByte = (backColour << 4) | (foreColour & 0x0F);
+    uint32_t flags;
 
     uint16_t attribute = attributeByte << 8;
     
-    while(*txt)
-        video_memory[(x++) + 80*y] = (uint16_t) (*(txt++)) | attribute;
+    if (y >= TEXT_ROWS) {
+        while(*txt)
+            video_memory[(x++) + 80*y] = (uint16_t) (*(txt++)) | attribute;
+        return;
+    }
+    flags = intr_save();
+    while(*txt && x < TEXT_COLS)
+        ROW(y)[x++] = (uint16_t) (*(txt++)) | attribute;
+    dirty_rows |= 1 << y;
+    shadow_gen++;
+    intr_restore(flags);
+    flush();
 }
 
-// Writes a single character out to the screen.
+// Puts a character in the shadow buffer, without flushing.
 
-void monitor_put(char c) {
+static void put_char(char c) {
     // The background colour is black (0), the foreground is white (7).
     uint8_t backColour = 0;
     uint8_t foreColour = 7;
@@ -86,7 +145,8 @@ void monitor_put(char c) {
             cursor_x = 79;
             cursor_y--;
         }
-        video_memory[cursor_x + 80*cursor_y] = (uint16_t) 0x20 | attribute;
+        ROW(cursor_y)[cursor_x] = (uint16_t) 0x20 | attribute;
+        dirty_rows |= 1 << cursor_y;
     }
         // Handle a tab by increasing the cursor's X, but only to a point
         // where it is divisible by 8.
@@ -104,7 +164,8 @@ void monitor_put(char c) {
     }
         // Handle any other printable character.
     else if (c >= ' ') {
-        video_memory[cursor_x + 80*cursor_y] = (uint16_t) c | attribute;
+        ROW(cursor_y)[cursor_x] = (uint16_t) c | attribute;
+        dirty_rows |= 1 << cursor_y;
         cursor_x++;
     }
 
@@ -117,26 +178,42 @@ void monitor_put(char c) {
 
     // Scroll the screen if needed.
     scroll();
-    update_cursor(cursor_y, cursor_x);
+}
+
+// Writes a single character out to the screen.
+
+void monitor_put(char c) {
+    uint32_t flags = intr_save();
+
+    put_char(c);
+    shadow_gen++;
+    intr_restore(flags);
+    flush();
 }
 
 // Clears the screen, by copying lots of spaces to the framebuffer.
 
 void monitor_clear() {
-
+    uint32_t flags = intr_save();
     int i;
-    for (i = 0; i < 80*25; i++) {
+
+    memset((uint8_t *) shadow, 0, sizeof(shadow));
+    for (i = 80*TEXT_ROWS; i < 80*25; i++) {
          video_memory[i] = 0;
     }
 
     // Move the hardware cursor back to the start.
     cursor_x = 0;
     cursor_y = 0;
-    update_cursor(cursor_y, cursor_x);
+    dirty_rows = (1 << TEXT_ROWS) - 1;
+    shadow_gen++;
+    intr_restore(flags);
+    flush();
 }
 
 void monitor_init() {
    unsigned short position = 0;
+   uint32_t y, x;
    // cursor LOW port to vga INDEX register
    outb(0x3D4, 0x0F);
    position |= ((unsigned short ) inb(0x3D5) & 0xFF);
@@ -144,41 +221,56 @@ void monitor_init() {
    // cursor HIGH port to vga INDEX register
    outb(0x3D4, 0x0E);
    position |= ((unsigned short ) inb(0x3D5) & 0xFF);
+   // Keep what the boot loader left on screen, the only time video
+   // memory is read
+   for (y = 0; y < TEXT_ROWS; y++)
+       for (x = 0; x < TEXT_COLS; x++)
+           shadow[y][x] = video_memory[y * TEXT_COLS + x];
+   top_line = 0;
    cursor_y = (position / 80) + 1;
    cursor_x = 0;
    scroll();
+   flush();
 }
 
-// Outputs a null-terminated ASCII string to the monitor.
+// Outputs a null-terminated ASCII string to the monitor, with a single
+// flush and cursor update at the end.
 
 void monitor_write(char *c) {
+    uint32_t flags = intr_save();
+
     while (*c)
-        monitor_put(*c++);
+        put_char(*c++);
+    shadow_gen++;
+    intr_restore(flags);
+    flush();
 }
 
 void monitor_write_hex(uint32_t n) {
     int tmp;
     char noZeroes = 1;
-
-    monitor_write("0x");
+    char buf[11] = "0x";
+    int j = 2;
 
     int i;
     for (i = 28; i >= 0; i -= 4) {
         tmp = (n >> i) & 0xF;
-        if (tmp == 0 && noZeroes != 0)
+        if (tmp == 0 && noZeroes != 0 && i != 0)
             continue;
 
         noZeroes = 0;
         if (tmp >= 0xA)
-            monitor_put(tmp - 0xA + 'a');
+            buf[j++] = tmp - 0xA + 'a';
         else
-            monitor_put(tmp + '0');
+            buf[j++] = tmp + '0';
     }
+    buf[j] = 0;
+    monitor_write(buf);
 }
 
 void monitor_write_dec(uint32_t n) {
     if (n == 0) {
-        monitor_put('0');
+        monitor_write("0");
         return;
     }
 
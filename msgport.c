@@ -0,0 +1,79 @@
+/* msgport.c - Krypton message port implementation
+ *
+ * Ports are plain lists guarded by forbid(); the owner task sleeps on
+ * mp_sig_bit and gets signalled whenever a message is linked in.
+ */
+
+#include "msgport.h"
+#include "task.h"
+#include "kmalloc.h"
+
+extern list_head_t tasks_wait;
+extern task_t * running_task;
+
+static void link_msg(msgport_t * port, message_t * msg, uint32_t type) {
+    forbid();
+    msg->mn_type = type;
+    add_tail(&port->mp_msg_list, (list_node_t *) msg);
+    permit();
+
+    if(port->mp_sig_task != NULL)
+        signal(port->mp_sig_task, port->mp_sig_bit);
+}
+
+void init_msgport(msgport_t * port, struct task_s * task) {
+    memset((uint8_t *) port, 0, sizeof(msgport_t));
+    port->ln_link.type = NT_MSGPORT;
+    new_list(&port->mp_msg_list);
+    port->mp_sig_task = task;
+    port->mp_sig_bit = TB_PORT;
+}
+
+msgport_t * create_msgport() {
+    msgport_t * port = (msgport_t *) kmalloc(sizeof(msgport_t));
+
+    if(port == NULL)
+        return NULL;
+
+    init_msgport(port, running_task);
+    return port;
+}
+
+void delete_msgport(msgport_t * port) {
+    memset((uint8_t *) port, 0, sizeof(msgport_t));
+    kfree(port);
+}
+
+void put_msg(msgport_t * port, message_t * msg) {
+    link_msg(port, msg, NT_MESSAGE);
+}
+
+message_t * get_msg(msgport_t * port) {
+    message_t * msg;
+
+    forbid();
+    msg = (message_t *) remove_head(&port->mp_msg_list);
+    /* A reply that left its port is no longer linked anywhere */
+    if(msg != NULL && msg->mn_type == NT_REPLYMSG)
+        msg->mn_type = NT_FREEMSG;
+    permit();
+    return msg;
+}
+
+void reply_msg(message_t * msg) {
+    if(msg->mn_reply_port == NULL) {
+        msg->mn_type = NT_FREEMSG;
+        return;
+    }
+    link_msg(msg->mn_reply_port, msg, NT_REPLYMSG);
+}
+
+message_t * wait_port(msgport_t * port) {
+    forbid();
+    while(get_head(&port->mp_msg_list) == NULL) {
+        wait(port->mp_sig_bit, &tasks_wait);
+        forbid();
+    }
+    permit();
+    return (message_t *) get_head(&port->mp_msg_list);
+}
@@ -0,0 +1,54 @@
+/*
+ * File:   msgport.h
+ *
+ *  Amiga-style message ports. Messages are linked straight into the
+ *  port list through their own node, so passing a message around
+ *  never allocates memory.
+ */
+
+#ifndef MSGPORT_H
+#define MSGPORT_H
+
+#include "common.h"
+
+struct task_s;
+
+struct message_s {
+    min_node_t mn_link;                 /* Link in the port message list */
+    uint32_t mn_type;                   /* NT_MESSAGE or NT_REPLYMSG */
+    struct msgport_s * mn_reply_port;   /* Where reply_msg() sends it back */
+    uint32_t mn_length;                 /* Total size of the message */
+};
+
+typedef struct message_s message_t;
+
+struct msgport_s {
+    list_node_t ln_link;
+    list_head_t mp_msg_list;            /* Pending messages, oldest first */
+    struct task_s * mp_sig_task;        /* Task to signal on arrival */
+    uint32_t mp_sig_bit;                /* Signal sent to mp_sig_task */
+};
+
+typedef struct msgport_s msgport_t;
+
+/* Initialize a port embedded in another structure */
+void init_msgport(msgport_t * port, struct task_s * task);
+
+/* Allocate a port owned by the running task */
+msgport_t * create_msgport();
+
+void delete_msgport(msgport_t * port);
+
+/* Queue a message on a port and signal its owner */
+void put_msg(msgport_t * port, message_t * msg);
+
+/* Unlink the oldest message of a port, or NULL if it is empty */
+message_t * get_msg(msgport_t * port);
+
+/* Send a message back to its reply port */
+void reply_msg(message_t * msg);
+
+/* Block until the port has a message, without removing it */
+message_t * wait_port(msgport_t * port);
+
+#endif
@@ -7,13 +7,19 @@
 #include "common.h"
 #include "kprintf.h"
 #include "idt.h"
+#include "trace.h"
+#include "profile.h"
+#include "log.h"
 
 static void keyboard_reset_on_panic(registers_t * regs);
 
 
 void panic (const char *msg)
 {
+  log_emergency();
   kprintf ("\n-----------------------\nSorry, a system error ocurred: %s\n", msg);
+  trace_dump();
+  profile_dump();
   asm volatile("cli");
   asm volatile("hlt");
 }
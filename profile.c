@@ -0,0 +1,134 @@
+/* profile.c - Krypton sampling profiler
+ *
+ * The RTC runs its periodic interrupt at 1024 Hz, independent of the
+ * scheduler tick, so samples do not line up with task switches. Each
+ * sample walks the ebp chain of the interrupted code, which needs the
+ * kernel built with frame pointers (make PROFILE=1 does that).
+ *
+ * profile_dump() output, read by profile2txt.py:
+ *
+ *   PROFILE begin hz=<rate> samples=<n> dropped=<n>
+ *   TASK <task pointer> <name>
+ *   S <task> <user> <eip> <caller> ...
+ *   PROFILE end
+ */
+
+#include "profile.h"
+
+#ifdef CONFIG_PROFILE
+
+#include "idt.h"
+#include "task.h"
+#include "mm.h"
+#include "serial.h"
+#include "kprintf.h"
+
+#define RTC_INDEX       0x70
+#define RTC_DATA        0x71
+#define RTC_NMI_OFF     0x80
+#define RTC_REG_A       0x0A
+#define RTC_REG_B       0x0B
+#define RTC_REG_C       0x0C
+#define RTC_PIE         0x40    /* Periodic interrupt enable, register B */
+
+extern task_t * running_task;
+
+static profile_sample_t profile_samples[PROFILE_SAMPLES];
+static volatile uint32_t profile_count;
+static volatile uint32_t profile_dropped;
+static volatile uint32_t profile_active;
+
+/* A frame is followed only if both of its words sit on one mapped
+   page and it lies above the previous one, so a bogus ebp from code
+   built without frame pointers ends the walk instead of faulting */
+static uint32_t walk_frames(uint32_t fp, uint32_t * pc) {
+    uint32_t depth = 0, limit = fp + 0x10000;
+
+    while(depth < PROFILE_DEPTH && fp != 0 && !(fp & 3) && fp < limit &&
+          (fp & (PAGE_SIZE - 1)) <= PAGE_SIZE - 8 && get_physaddr((void *) fp) != NULL) {
+        if((pc[depth++] = ((uint32_t *) fp)[1]) == 0)
+            break;
+        if(((uint32_t *) fp)[0] <= fp)
+            break;
+        fp = ((uint32_t *) fp)[0];
+    }
+    return depth;
+}
+
+static void rtc_callback(registers_t * regs) {
+    profile_sample_t * s;
+
+    /* The RTC raises no further interrupts until C has been read */
+    outb(RTC_INDEX, RTC_REG_C);
+    inb(RTC_DATA);
+
+    if(!profile_active)
+        return;
+    if(profile_count == PROFILE_SAMPLES) {
+        profile_dropped++;
+        return;
+    }
+    s = &profile_samples[profile_count];
+    s->ps_task = (uint32_t) running_task;
+    s->ps_user = (regs->cs & 3) != 0;
+    s->ps_pc[0] = regs->eip;
+    s->ps_depth = 1 + walk_frames(regs->ebp, &s->ps_pc[1]);
+    profile_count++;
+}
+
+void profile_init() {
+    uint8_t prev;
+
+    /* Called from init(), interrupts are still off */
+    register_interrupt_handler(IRQ8, &rtc_callback);
+    outb(RTC_INDEX, RTC_NMI_OFF | RTC_REG_A);
+    prev = inb(RTC_DATA);
+    outb(RTC_INDEX, RTC_NMI_OFF | RTC_REG_A);
+    outb(RTC_DATA, (prev & 0xF0) | PROFILE_RTC_RATE);
+    outb(RTC_INDEX, RTC_NMI_OFF | RTC_REG_B);
+    prev = inb(RTC_DATA);
+    outb(RTC_INDEX, RTC_NMI_OFF | RTC_REG_B);
+    outb(RTC_DATA, prev | RTC_PIE);
+    /* Leave NMIs enabled again */
+    outb(RTC_INDEX, RTC_REG_C);
+    inb(RTC_DATA);
+    init_serial();
+    profile_active = 1;
+}
+
+void profile_reset() {
+    profile_active = 0;
+    profile_count = 0;
+    profile_dropped = 0;
+    profile_active = 1;
+}
+
+void profile_dump() {
+    profile_sample_t * s;
+    uint32_t i, j;
+    char line[128];
+    char * p;
+
+    profile_active = 0;
+    sprintf(line, "PROFILE begin hz=%u samples=%u dropped=%u\n",
+            32768 >> (PROFILE_RTC_RATE - 1), profile_count, profile_dropped);
+    serial_write(line);
+    task_dump_names();
+
+    for (i = 0; i < profile_count; i++) {
+        s = &profile_samples[i];
+        sprintf(line, "S %08x %u", s->ps_task, s->ps_user);
+        p = line + strlen(line);
+        for (j = 0; j < s->ps_depth; j++, p += 9)
+            sprintf(p, " %08x", s->ps_pc[j]);
+        *p++ = '\n';
+        *p = '\0';
+        serial_write(line);
+    }
+    serial_write("PROFILE end\n");
+
+    /* Start a fresh profile */
+    profile_reset();
+}
+
+#endif /* CONFIG_PROFILE */
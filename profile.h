@@ -0,0 +1,49 @@
+/*
+ * File:   profile.h
+ *
+ *  Statistical profiler. The RTC interrupt samples the interrupted
+ *  program counter, its frame pointer chain and the running task;
+ *  profile2txt.py symbolizes the serial dump against kry_kern.
+ *  Built only with CONFIG_PROFILE (make PROFILE=1).
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+
+#ifdef CONFIG_PROFILE
+
+#define PROFILE_SAMPLES     4096    /* Sampling stops once these are used */
+#define PROFILE_DEPTH       6       /* Callers kept per sample */
+#define PROFILE_RTC_RATE    6       /* 32768 >> (rate - 1) = 1024 Hz */
+
+struct profile_sample_s {
+    uint32_t ps_task;                   /* Running task */
+    uint16_t ps_user;                   /* Interrupted in ring 3 */
+    uint16_t ps_depth;                  /* Valid entries in ps_pc */
+    uint32_t ps_pc[PROFILE_DEPTH + 1];  /* eip first, then the callers */
+};
+
+typedef struct profile_sample_s profile_sample_t;
+
+/* Program the RTC periodic interrupt and start sampling, called
+   with interrupts disabled */
+void profile_init();
+
+/* Drop the samples taken so far and start over */
+void profile_reset();
+
+/* Write the samples to the serial port with polled output, sampling is
+   paused meanwhile. Slow, so only at the end of a bench run or on panic */
+void profile_dump();
+
+#else
+
+#define profile_init()      do { } while (0)
+#define profile_reset()     do { } while (0)
+#define profile_dump()      do { } while (0)
+
+#endif /* CONFIG_PROFILE */
+
+#endif
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# profile2txt.py - symbolize a Krypton serial profile dump
+#
+# Usage: profile2txt.py [--kernel kry_kern] [--folded] serial.log
+#
+# Prints flat per-function and per-task profiles, or with --folded one
+# "task;outer;...;inner count" line per call chain for flamegraph.pl.
+
+import argparse
+import bisect
+import collections
+import subprocess
+import sys
+
+
+def load_symbols(kernel, nm):
+    out = subprocess.run([nm, "-n", kernel], check=True, capture_output=True,
+                         text=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[1] in "tTwW":
+            addrs.append(int(fields[0], 16))
+            names.append(fields[2])
+    return addrs, names
+
+
+def symbolize(addrs, names, pc):
+    i = bisect.bisect_right(addrs, pc) - 1
+    return names[i] if i >= 0 else "0x%08x" % pc
+
+
+def parse(lines):
+    tasks, samples = {}, []
+    inside = False
+    for line in lines:
+        line = line.strip()
+        if line.startswith("PROFILE begin"):
+            inside = True
+        elif not inside:
+            continue
+        elif line == "PROFILE end":
+            inside = False
+        elif line.startswith("TASK "):
+            _, ptr, name = (line.split(None, 2) + [""])[:3]
+            tasks[int(ptr, 16)] = name
+        elif line.startswith("S "):
+            fields = line.split()
+            samples.append((int(fields[1], 16), fields[2] == "1",
+                            [int(pc, 16) for pc in fields[3:]]))
+    return tasks, samples
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--kernel", default="kry_kern")
+    ap.add_argument("--nm", default="nm")
+    ap.add_argument("--folded", action="store_true")
+    ap.add_argument("log", nargs="?")
+    args = ap.parse_args()
+
+    addrs, names = load_symbols(args.kernel, args.nm)
+    src = open(args.log, errors="replace") if args.log else sys.stdin
+    tasks, samples = parse(src)
+    if not samples:
+        sys.exit("no profile samples found")
+
+    def task_name(ptr):
+        return tasks.get(ptr, "task %08x" % ptr)
+
+    if args.folded:
+        stacks = collections.Counter()
+        for task, _, pcs in samples:
+            frames = [symbolize(addrs, names, pc) for pc in reversed(pcs)]
+            stacks[";".join([task_name(task)] + frames)] += 1
+        for stack, count in stacks.most_common():
+            print(stack, count)
+        return
+
+    total = len(samples)
+    funcs, by_task, user = collections.Counter(), collections.Counter(), 0
+    for task, in_user, pcs in samples:
+        funcs[symbolize(addrs, names, pcs[0])] += 1
+        by_task[task_name(task)] += 1
+        user += in_user
+    print("%d samples, %.1f%% in ring 3\n" % (total, 100.0 * user / total))
+    print("%8s %6s  %s" % ("samples", "%", "function"))
+    for name, count in funcs.most_common():
+        print("%8d %6.2f  %s" % (count, 100.0 * count / total, name))
+    print("\n%8s %6s  %s" % ("samples", "%", "task"))
+    for name, count in by_task.most_common():
+        print("%8d %6.2f  %s" % (count, 100.0 * count / total, name))
+
+
+if __name__ == "__main__":
+    main()
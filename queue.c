@@ -1,17 +1,39 @@
 #include "queue.h"
 #include "kmalloc.h"
+#include "trace.h"
 
 
 extern list_head_t tasks_wait;
 extern task_t * running_task;
 
+/* Allocate a message and copy the data in, or return NULL */
+static queue_msg_t * alloc_msg(queue_t * queue, char * msg) {
+    queue_msg_t * new_msg = (queue_msg_t *) kmalloc(sizeof(queue_msg_t));
+    
+    if (new_msg == NULL)
+        return NULL;
+    memset((uint8_t *) new_msg, 0, sizeof(queue_msg_t));
+    
+    if(msg != NULL) {
+        new_msg->data_ptr = kmalloc(queue->elem_sz);
+        
+        if (new_msg->data_ptr == NULL) {
+            kfree(new_msg);
+            return NULL;
+        }
+        
+        memcpy((uint8_t *) new_msg->data_ptr, (uint8_t *)msg, queue->elem_sz);
+    }
+    return new_msg;
+}
+
 queue_t * create_queue(uint32_t max_slots, uint32_t elem_sz) {
-    forbid();
     queue_t * new_queue = (queue_t*) kmalloc(sizeof(queue_t));
     
     if(new_queue == NULL)
         return NULL;
     
+    forbid();
     memset(new_queue, 0, sizeof(queue_t));
     
     new_list((list_head_t*) new_queue);
@@ -35,25 +57,14 @@ queue_msg_t * queue_send(queue_t* queue, char * msg, uint32_t mode) {
     task_t * aux;
     queue_msg_t * new_msg;
     
+    trace_event(TRACE_QUEUE_SEND, (uint32_t) queue);
     forbid();
     if (queue->free_slots > 0) {
 
-        new_msg = (queue_msg_t *) kmalloc(sizeof(queue_msg_t));
-        memset((uint8_t *) new_msg, 0, sizeof(queue_msg_t));
-        
-        if (new_msg == NULL)
+        if ((new_msg = alloc_msg(queue, msg)) == NULL) {
+            permit();
             return NULL;
-            
-        if(msg != NULL) {
-
-            new_msg->data_ptr = kmalloc(queue->elem_sz);
-        
-            if (new_msg->data_ptr == NULL)
-                return NULL;
-            
-            memcpy((uint8_t *) new_msg->data_ptr, (uint8_t *)msg, queue->elem_sz);
         }
-        else new_msg->data_ptr = NULL;
         
         add_head(queue, new_msg);
         if(queue->free_slots-- == queue->max_slots) {
@@ -68,33 +79,25 @@ queue_msg_t * queue_send(queue_t* queue, char * msg, uint32_t mode) {
             wait(TB_QUEUE, &queue->waiters);
             forbid();
         } while (queue->free_slots == 0);
-        new_msg = (queue_msg_t *) kmalloc(sizeof(queue_msg_t));
-        memset((uint8_t *)new_msg, 0, sizeof(queue_msg_t));
-        if (new_msg == NULL)
+        if ((new_msg = alloc_msg(queue, msg)) == NULL) {
+            permit();
             return NULL;
-        
-        if(msg != NULL) {
-            new_msg->data_ptr = kmalloc(queue->elem_sz);
-        
-            if (new_msg->data_ptr == NULL)
-                return NULL;
-            
-            memcpy((uint8_t *)new_msg->data_ptr, (uint8_t *) msg, queue->elem_sz);
         }
-        else new_msg->data_ptr = NULL;
         
         add_head(queue, new_msg);
         queue->free_slots--;
         permit();
         return new_msg;
     }
-    else return NULL;
+    permit();
+    return NULL;
 }
 
 char * queue_recv(queue_t * queue, char * ptr, uint32_t mode) {
     queue_msg_t * msg;
     task_t * aux;
     
+    trace_event(TRACE_QUEUE_RECV, (uint32_t) queue);
     forbid();
     if (queue->free_slots < queue->max_slots) {
         msg = remove_tail(queue);
@@ -129,6 +132,7 @@ char * queue_recv(queue_t * queue, char * ptr, uint32_t mode) {
         permit();
         return ptr;
     }
-    else return NULL;
+    permit();
+    return NULL;
 }
 
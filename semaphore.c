@@ -0,0 +1,165 @@
+/* semaphore.c - Krypton semaphores and priority inheritance mutexes
+ *
+ * The counters are only touched with atomic instructions. A task that
+ * has to sleep does the final counter update and links itself into the
+ * waiter list inside the same forbid() section, so whoever releases
+ * always finds it there.
+ */
+
+#include "semaphore.h"
+#include "atomic.h"
+#include "task.h"
+
+extern list_head_t tasks_ready;
+extern task_t * running_task;
+
+/***************************************
+ * Counting semaphores
+ ***************************************/
+
+void init_semaphore(semaphore_t * sem, int32_t count) {
+    memset((uint8_t *) sem, 0, sizeof(semaphore_t));
+    sem->ln_link.type = NT_SEMAPOHORE;
+    sem->sm_count = count;
+    new_list(&sem->sm_waiters);
+}
+
+uint32_t attempt_semaphore(semaphore_t * sem) {
+    int32_t count = sem->sm_count;
+
+    while(count > 0) {
+        if(atomic_cmpxchg(&sem->sm_count, count, count - 1))
+            return 1;
+        count = sem->sm_count;
+    }
+    return 0;
+}
+
+void obtain_semaphore(semaphore_t * sem) {
+    if(attempt_semaphore(sem))
+        return;
+
+    forbid();
+    if(atomic_add(&sem->sm_count, -1) >= 0) {
+        permit();
+        return;
+    }
+    /* release_semaphore() hands its unit straight to us */
+    wait(TB_SEMAPHORE, &sem->sm_waiters);
+}
+
+void release_semaphore(semaphore_t * sem) {
+    int32_t count = sem->sm_count;
+
+    /* Nobody is waiting, just put the unit back */
+    while(count >= 0) {
+        if(atomic_cmpxchg(&sem->sm_count, count, count + 1))
+            return;
+        count = sem->sm_count;
+    }
+
+    forbid();
+    if(atomic_add(&sem->sm_count, 1) <= 0)
+        signal((task_t *) get_head(&sem->sm_waiters), TB_SEMAPHORE);
+    permit();
+}
+
+/***************************************
+ * Mutexes
+ ***************************************/
+
+/* Raise a task to at least pri, following the chain of mutex owners
+   it may itself be blocked on */
+static void inherit_priority(task_t * task, int32_t pri) {
+    mutex_t * mx;
+
+    while(task != NULL && task->ln_link.pri < pri) {
+        task->ln_link.pri = pri;
+
+        if(task->flags & TS_READY) {
+            /* Keep the ready list sorted */
+            if(!(task->flags & TS_RUN)) {
+                remove((list_node_t *) task);
+                enqueue(&tasks_ready, (list_node_t *) task);
+            }
+            return;
+        }
+        if((mx = task->blocked_on) == NULL)
+            return;
+        remove((list_node_t *) task);
+        enqueue(&mx->mx_waiters, (list_node_t *) task);
+        task = mx->mx_owner;
+    }
+}
+
+static void take_mutex(mutex_t * mx, task_t * task) {
+    mx->mx_owner = task;
+    mx->mx_nest_count = 1;
+    task->mutexes_held++;
+}
+
+void init_mutex(mutex_t * mx) {
+    memset((uint8_t *) mx, 0, sizeof(mutex_t));
+    mx->ln_link.type = NT_SEMAPOHORE;
+    mx->mx_queue_count = -1;
+    new_list(&mx->mx_waiters);
+}
+
+uint32_t attempt_mutex(mutex_t * mx) {
+    if(atomic_cmpxchg(&mx->mx_queue_count, -1, 0)) {
+        take_mutex(mx, running_task);
+        return 1;
+    }
+    if(mx->mx_owner == running_task) {
+        atomic_add(&mx->mx_queue_count, 1);
+        mx->mx_nest_count++;
+        return 1;
+    }
+    return 0;
+}
+
+void obtain_mutex(mutex_t * mx) {
+    if(attempt_mutex(mx))
+        return;
+
+    forbid();
+    if(atomic_add(&mx->mx_queue_count, 1) == 0) {
+        /* Released while we were getting here */
+        take_mutex(mx, running_task);
+        permit();
+        return;
+    }
+    inherit_priority(mx->mx_owner, running_task->ln_link.pri);
+    running_task->blocked_on = mx;
+    /* release_mutex() makes us the owner before waking us up */
+    wait(TB_SEMAPHORE, &mx->mx_waiters);
+}
+
+void release_mutex(mutex_t * mx) {
+    task_t * waiter, * next;
+
+    if(--mx->mx_nest_count > 0) {
+        atomic_add(&mx->mx_queue_count, -1);
+        return;
+    }
+
+    mx->mx_owner = NULL;
+    /* Drop any borrowed priority once the last mutex is gone */
+    if(--running_task->mutexes_held == 0)
+        running_task->ln_link.pri = running_task->base_pri;
+
+    if(atomic_cmpxchg(&mx->mx_queue_count, 0, -1))
+        return;
+
+    /* Someone is waiting, hand the mutex over to the first in line */
+    forbid();
+    atomic_add(&mx->mx_queue_count, -1);
+    waiter = (task_t *) get_head(&mx->mx_waiters);
+    next = (task_t *) get_next((list_node_t *) waiter);
+    waiter->blocked_on = NULL;
+    take_mutex(mx, waiter);
+    if(next != NULL)
+        inherit_priority(waiter, next->ln_link.pri);
+    signal(waiter, TB_SEMAPHORE);
+    permit();
+}
@@ -0,0 +1,57 @@
+/* 
+ * File:   semaphore.h
+ *
+ *  Counting semaphores and Amiga SignalSemaphore-like mutexes.
+ *  Both take and give back units with a single atomic instruction
+ *  when nobody has to wait, and only fall back to forbid() and the
+ *  wait()/signal() machinery under contention.
+ */
+
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "common.h"
+
+struct task_s;
+
+struct semaphore_s {
+    list_node_t ln_link;
+    volatile int32_t sm_count;      /* Free units, or minus the waiters */
+    list_head_t sm_waiters;         /* Blocked tasks, by priority */
+};
+
+typedef struct semaphore_s semaphore_t;
+
+struct mutex_s {
+    list_node_t ln_link;
+    volatile int32_t mx_queue_count;/* -1 when free, else nests+waiters-1 */
+    struct task_s * mx_owner;
+    uint32_t mx_nest_count;
+    list_head_t mx_waiters;         /* Blocked tasks, by priority */
+};
+
+typedef struct mutex_s mutex_t;
+
+void init_semaphore(semaphore_t * sem, int32_t count);
+
+/* Take one unit, blocking while there is none */
+void obtain_semaphore(semaphore_t * sem);
+
+/* Take one unit if available. Returns 0 if it would block */
+uint32_t attempt_semaphore(semaphore_t * sem);
+
+/* Give back one unit, waking the highest priority waiter */
+void release_semaphore(semaphore_t * sem);
+
+void init_mutex(mutex_t * mx);
+
+/* Lock a mutex. Nests for the owner, and lends the caller's priority
+   to the owner while the caller waits */
+void obtain_mutex(mutex_t * mx);
+
+/* Lock a mutex if it is free or already ours. Returns 0 otherwise */
+uint32_t attempt_mutex(mutex_t * mx);
+
+void release_mutex(mutex_t * mx);
+
+#endif /* SEMAPHORE_H */
@@ -0,0 +1,238 @@
+/* serial.c - Krypton 16550 UART driver
+ *
+ * Output is polled until serial_irq_init(). From then on writers copy
+ * into tx_ring and at most turn the transmit interrupt on; the IRQ4
+ * handler moves up to a FIFO worth of bytes per interrupt and turns
+ * it off again when the ring runs dry. Received bytes go to rx_ring
+ * and wake the device task.
+ */
+
+#include "serial.h"
+#include "idt.h"
+#include "cpu.h"
+#include "task.h"
+#include "device.h"
+
+/* UART registers, relative to the port base */
+#define UART_DATA       0       // Data, or divisor low byte with DLAB set
+#define UART_IER        1       // Interrupt enable, or divisor high byte
+#define UART_IIR        2       // Interrupt identification, on read
+#define UART_FCR        2       // FIFO control, on write
+#define UART_LCR        3       // Line control
+#define UART_MCR        4       // Modem control
+#define UART_LSR        5       // Line status
+
+#define LCR_8N1         0x03
+#define LCR_DLAB        0x80
+#define LSR_DR          0x01    // Receive data ready
+#define LSR_THRE        0x20    // Transmit holding register empty
+#define IER_RX          0x01    // Received data available
+#define IER_TX          0x02    // Transmit holding register empty
+#define IIR_NONE        0x01    // No interrupt pending
+#define MCR_DTR_RTS     0x03
+#define MCR_OUT2        0x08    // Gates the UART interrupt onto the bus
+#define UART_FIFO_SIZE  16
+
+extern list_head_t tasks_wait;
+extern task_t * running_task;
+
+uint32_t serial_tx_dropped;
+
+static uint32_t serial_ready;
+static uint32_t serial_irq_mode;
+static volatile uint32_t tx_busy;   // Transmit interrupt enabled
+
+static char tx_ring[SERIAL_TX_SIZE];
+static volatile uint32_t tx_head, tx_tail;
+static char rx_ring[SERIAL_RX_SIZE];
+static volatile uint32_t rx_head, rx_tail;
+
+static task_t * serial_task;
+static device_t serial_dev;
+
+void init_serial() {
+    if(serial_ready)
+        return;
+    serial_ready = 1;
+    outb(COM1_PORT + UART_IER, 0x00);       // No interrupts
+    outb(COM1_PORT + UART_LCR, LCR_DLAB);
+    outb(COM1_PORT + UART_DATA, 1);         // 115200 / 1
+    outb(COM1_PORT + UART_IER, 0);
+    outb(COM1_PORT + UART_LCR, LCR_8N1);
+    outb(COM1_PORT + UART_FCR, 0xC7);       // Enable and clear FIFOs, 14 byte trigger
+    outb(COM1_PORT + UART_MCR, MCR_DTR_RTS);
+}
+
+void serial_putc(char c) {
+    while((inb(COM1_PORT + UART_LSR) & LSR_THRE) == 0);
+    outb(COM1_PORT + UART_DATA, c);
+}
+
+void serial_write(const char * str) {
+    while(*str) {
+        if(*str == '\n')
+            serial_putc('\r');
+        serial_putc(*str++);
+    }
+}
+
+/* Called with interrupts off. THRE means the whole FIFO is empty */
+static void tx_fill() {
+    uint32_t n;
+
+    for(n = 0; n < UART_FIFO_SIZE && tx_tail != tx_head; n++)
+        outb(COM1_PORT + UART_DATA, tx_ring[tx_tail++ & (SERIAL_TX_SIZE - 1)]);
+    if(tx_tail == tx_head && tx_busy) {
+        tx_busy = 0;
+        outb(COM1_PORT + UART_IER, IER_RX);
+    }
+}
+
+static void serial_isr(registers_t * regs) {
+    uint8_t lsr;
+    uint32_t got = 0;
+
+    (void) regs;
+    /* Writers may be nested interrupt handlers */
+    disable();
+    while(!(inb(COM1_PORT + UART_IIR) & IIR_NONE)) {
+        lsr = inb(COM1_PORT + UART_LSR);
+        while(lsr & LSR_DR) {
+            /* A full ring drops the newest byte */
+            if(rx_head - rx_tail < SERIAL_RX_SIZE)
+                rx_ring[rx_head++ & (SERIAL_RX_SIZE - 1)] = inb(COM1_PORT + UART_DATA);
+            else
+                inb(COM1_PORT + UART_DATA);
+            got = 1;
+            lsr = inb(COM1_PORT + UART_LSR);
+        }
+        if(lsr & LSR_THRE)
+            tx_fill();
+    }
+    if(got && serial_task != NULL)
+        signal(serial_task, TB_RESUME);
+    enable();
+}
+
+void serial_irq_init() {
+    init_serial();
+    register_interrupt_handler(IRQ4, &serial_isr);
+    outb(COM1_PORT + UART_MCR, MCR_DTR_RTS | MCR_OUT2);
+    outb(COM1_PORT + UART_IER, IER_RX);
+    serial_irq_mode = 1;
+}
+
+uint32_t serial_tx_room() {
+    return SERIAL_TX_SIZE - (tx_head - tx_tail);
+}
+
+uint32_t serial_send(const char * buf, uint32_t len) {
+    uint32_t i, flags;
+
+    if(!serial_irq_mode) {
+        init_serial();
+        for(i = 0; i < len; i++) {
+            if(buf[i] == '\n')
+                serial_putc('\r');
+            serial_putc(buf[i]);
+        }
+        return len;
+    }
+
+    flags = intr_save();
+    for(i = 0; i < len; i++) {
+        if(serial_tx_room() < (buf[i] == '\n' ? 2U : 1U))
+            break;
+        if(buf[i] == '\n')
+            tx_ring[tx_head++ & (SERIAL_TX_SIZE - 1)] = '\r';
+        tx_ring[tx_head++ & (SERIAL_TX_SIZE - 1)] = buf[i];
+    }
+    serial_tx_dropped += len - i;
+    /* The UART raises THRE as soon as the interrupt is enabled */
+    if(!tx_busy && tx_head != tx_tail) {
+        tx_busy = 1;
+        outb(COM1_PORT + UART_IER, IER_RX | IER_TX);
+    }
+    intr_restore(flags);
+    return i;
+}
+
+void serial_kprintf_sink(const char * buf, uint32_t len) {
+    serial_send(buf, len);
+}
+
+/* Copy what has been received into the request, sleeping until there
+   is at least one byte */
+static uint32_t serial_read(iorq_t * iorq, uint32_t max_len) {
+    char buf[SERIAL_RX_SIZE];
+    uint32_t n = 0;
+
+    if(max_len > SERIAL_RX_SIZE)
+        max_len = SERIAL_RX_SIZE;
+    disable();
+    while(rx_head == rx_tail) {
+        /* Interrupts stay off until wait() has us on the list, so the
+           ISR cannot signal in between */
+        if(iorq->io_flags & IOF_ABORT) {
+            enable();
+            return 0;
+        }
+        wait(TB_RESUME | TB_ABORT, &tasks_wait);
+        disable();
+    }
+    running_task->sigs_waiting &= ~(TB_RESUME | TB_ABORT);
+    while(n < max_len && rx_head != rx_tail)
+        buf[n++] = rx_ring[rx_tail++ & (SERIAL_RX_SIZE - 1)];
+    enable();
+    return io_scatter(iorq, 0, buf, n);
+}
+
+void * serial_device(void * arg) {
+    iorq_t * iorq;
+    uint32_t i, max_len, len;
+    char chunk[256];
+
+    (void) arg;
+    memset((uint8_t *) &serial_dev, 0, sizeof(device_t));
+    strcpy(serial_dev.ln_link.name, "org.era.dev.serial");
+    init_msgport(&serial_dev.iorq_port, running_task);
+    serial_task = running_task;
+    serial_irq_init();
+    register_device_node(&serial_dev);
+
+    for(;;) {
+        wait_port(&serial_dev.iorq_port);
+        iorq = (iorq_t *) get_msg(&serial_dev.iorq_port);
+        max_len = io_length(iorq);
+        switch(iorq->io_desc) {
+        case DC_READ:
+            if(max_len == 0) {
+                iorq->io_error = IOERR_BADLENGTH;
+                break;
+            }
+            iorq->io_actual = serial_read(iorq, max_len);
+            if(iorq->io_flags & IOF_ABORT)
+                iorq->io_error = IOERR_ABORTED;
+            break;
+        case DC_WRITE:
+            /* Writes through the device are never dropped: wait a tick
+               whenever the ring is too full for the next chunk */
+            for(i = 0; i < max_len; i += len) {
+                len = io_gather(iorq, i, chunk, sizeof(chunk));
+                while(serial_tx_room() < 2 * len)
+                    delay(1);
+                serial_send(chunk, len);
+            }
+            iorq->io_actual = max_len;
+            break;
+        case DC_FLUSH:
+            while(tx_head != tx_tail)
+                delay(1);
+            break;
+        default:
+            iorq->io_error = IOERR_NOCMD;
+        }
+        reply_msg((message_t *) iorq);
+    }
+    return NULL;
+}
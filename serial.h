@@ -0,0 +1,49 @@
+/*
+ * File:   serial.h
+ *
+ *  16550 UART driver for the first PC serial port. The polled calls
+ *  work from any context, early boot and panics included; once
+ *  serial_irq_init() has run, serial_send() only queues into a ring
+ *  that the IRQ4 handler drains through the TX FIFO.
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "common.h"
+
+#define COM1_PORT       0x3F8
+
+#define SERIAL_TX_SIZE  4096    /* Output ring, a power of two */
+#define SERIAL_RX_SIZE  256     /* Input ring, a power of two */
+
+/* Set COM1 up for 115200 baud, 8N1, FIFOs on. Only the first call
+   touches the UART */
+void init_serial();
+
+/* Polled output, waits for the transmitter */
+void serial_putc(char c);
+
+/* Write a string, turning \n into \r\n */
+void serial_write(const char * str);
+
+/* Switch output to the interrupt driven ring and turn on reception */
+void serial_irq_init();
+
+/* Queue len bytes for output, turning \n into \r\n. Never waits:
+   returns how many bytes fitted in the ring, the rest are dropped */
+uint32_t serial_send(const char * buf, uint32_t len);
+
+/* Free space in the output ring */
+uint32_t serial_tx_room();
+
+/* Bytes lost because the output ring was full */
+extern uint32_t serial_tx_dropped;
+
+/* kprintf() sink, copies everything printed to the serial port */
+void serial_kprintf_sink(const char * buf, uint32_t len);
+
+/* Device task registering "org.era.dev.serial" */
+void * serial_device(void * arg);
+
+#endif
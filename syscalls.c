@@ -2,6 +2,7 @@
 #include "task.h"
 #include "kmalloc.h"
 #include "mm.h"
+#include "trace.h"
 
 extern uint32_t sched_state;
 extern uint32_t forbid_counter;
@@ -18,13 +19,16 @@ void syscall(registers_t *regs) {
     mm_args * mm = (mm_args *) regs->ebx;
     
     asm volatile("sti");
+    trace_event(TRACE_SYSCALL, regs->eax);
     switch(regs->eax) {
         case SYSCALL_YIELD: _yield(); break;
         case SYSCALL_KMALLOC: *ret_val = _kmalloc(*ret_val); break;
         case SYSCALL_KFREE: _kfree(regs->ebx); break;
         case SYSCALL_MMMAP: mm->virtualaddr = mm_map(mm->physaddr, mm->virtualaddr, mm->flags); break;
         case SYSCALL_MMUNMAP: mm_unmap(regs->ebx); break;
+        case SYSCALL_NOP: break;
     }
+    trace_event(TRACE_SYSCALL_EXIT, regs->eax);
     asm volatile("cli");
 }
 
@@ -12,6 +12,8 @@ enum SysCalls {
     SYSCALL_KFREE,
     SYSCALL_MMMAP,
     SYSCALL_MMUNMAP,
+    /* MEASUREMENT */
+    SYSCALL_NOP, /* does nothing, for timing the kernel entry and exit */
 };
 
 void syscall(registers_t *regs);
@@ -4,14 +4,46 @@
 #include "common.h"
 #include "cpu.h"
 #include "syscalls.h"
+#include "mm.h"
+#include "trace.h"
+#include "kmalloc.h"
+#include "timer.h"
+#include "kprintf.h"
+#include "serial.h"
 
 list_head_t tasks_ready;
 list_head_t tasks_wait;
+list_head_t tasks_all;
 task_t * running_task;
+extern void * kernelpagedirPtr;
 int wait_lock;
 int forbid_counter;
 int k_reenter;
 uint32_t sched_state;
+uint64_t sched_idle_tsc;
+
+/* The task behind its link in tasks_all */
+#define ALL_LINK_TASK(node) \
+    ((task_t *) ((uint8_t *) (node) - __builtin_offsetof(task_t, all_link)))
+
+/* Accounting clock, stuck at 0 on CPUs without a TSC */
+static inline uint64_t sched_clock() {
+    return (cpu_features_edx & CPU_FEAT_TSC) ? rdtsc() : 0;
+}
+
+static void account_wakeup(task_stats_t * stats, uint64_t delta) {
+    uint32_t mhz = tsc_mhz(), us, bucket;
+
+    if(mhz == 0)
+        return;
+    us = (delta > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) delta) / mhz;
+    bucket = us ? 32 - __builtin_clz(us) : 0;
+    if(bucket >= TASK_LAT_BUCKETS)
+        bucket = TASK_LAT_BUCKETS - 1;
+    stats->wake_hist[bucket]++;
+    if(us > stats->wake_max_us)
+        stats->wake_max_us = us;
+}
 
 void forbid() {
     forbid_counter++;
@@ -23,41 +55,81 @@ void permit() {
 }
 
 task_t * create_task(void* (*code)(void*), char * task_name, uint32_t task_pri, uint32_t stack_size) {
-    task_t * new_task = (task_t *) kmalloc(sizeof(task_t));
-    uint32_t* new_stack = (uint32_t*) kmalloc(stack_size);
+    task_t * new_task;
+    uint32_t new_stack;
     
+    /* Keep an unmapped guard page below the stack */
+    if(stack_size > MM_STACK_TOP - MM_STACK_ZONE - PAGE_SIZE)
+        return NULL;
+    stack_size = (stack_size + PAGE_SIZE - 1) & PAGE_MASK;
+    new_stack = MM_STACK_TOP - stack_size;
+    
+    new_task = (task_t *) kmalloc(sizeof(task_t));
     if(new_task == NULL)
-        panic("allocating task - not enough memory");
-        
-    if(new_stack == NULL)
-        panic("allocating stack - not enough memory");
+        return NULL;
         
     memset(new_task, 0, sizeof(task_t));
     
+    /* The new task starts as a copy-on-write image of its creator */
+    new_task->page_dir = clone_actual_directory();
+    if(new_task->page_dir == NULL) {
+        kfree(new_task);
+        return NULL;
+    }
+    
+    /* The stack is only reserved, pages get mapped as it grows */
+    new_list(&new_task->vm_regions);
+    if(!mm_clone_regions(&new_task->vm_regions, &running_task->vm_regions) ||
+       mm_reserve(&new_task->vm_regions, new_stack, stack_size, PAGE_WRITE | PAGE_USER) == NULL) {
+        destroy_address_space(new_task->page_dir);
+        mm_release_regions(&new_task->vm_regions);
+        kfree(new_task);
+        return NULL;
+    }
+    
     new_task->task_state.eip = (uint32_t) code;
-    new_task->task_state.esp = ((uint32_t) new_stack)+stack_size;
+    new_task->task_state.esp = MM_STACK_TOP;
     new_task->task_state.ss = new_task->task_state.ds = 0x23;
     new_task->task_state.cs = 0x1b;
     new_task->task_state.eflags = 0x3200;
-    new_task->stack_end = new_stack;
+    new_task->stack_end = (uint32_t *) new_stack;
     new_task->ln_link.pri = task_pri;
+    new_task->base_pri = task_pri;
     new_task->flags |= TS_READY;
+    init_msgport(&new_task->reply_port, new_task);
     memcpy(new_task->ln_link.name, task_name, MAX_TASK_NAME_LENGTH);
     
     forbid();
+    add_tail(&tasks_all, (list_node_t *) &new_task->all_link);
     enqueue(&tasks_ready, (list_node_t*) new_task);
     permit();
     return new_task;
 }
 
+static void free_task(task_t * task) {
+    /* Never free the directory we are running on */
+    if(task->page_dir == act_page_directory)
+        switch_page_directory(kernelpagedirPtr);
+    destroy_address_space(task->page_dir);
+    mm_release_regions(&task->vm_regions);
+    kfree(task);
+}
+
 void destroy_task(task_t * task) {
+    kheap_leak_report(task);
     forbid();
+    remove((list_node_t *) &task->all_link);
+    if(task == running_task) {
+        /* This code still runs on the task's stack, in its address
+           space: switch_tasks() frees it once it is switched out */
+        task->flags = (task->flags & ~TS_READY) | TS_DEAD;
+        permit();
+        yield();
+        for(;;);
+    }
     remove((list_node_t*) task);
-    kfree(task->stack_end);
-    kfree(task);
+    free_task(task);
     permit();
-    if (task == running_task)
-        yield();
 }
 
 uint32_t schedule() {
@@ -79,7 +151,9 @@ uint32_t schedule() {
 /* This function gets called from the interrupt handler if a task switch
  * is needed by testing NEED_TASK_SWITCH */
 void switch_tasks(registers_t * cpu_context) {
-    task_t * next_task;
+    task_t * next_task, * prev_task = running_task;
+    uint64_t now = sched_clock(), idle_start = now;
+    int idled = 0;
 
     /* Unset the task's running flag, for the dispatcher to know
        the task is not running, so it will not corrupt it's stack */
@@ -87,6 +161,8 @@ void switch_tasks(registers_t * cpu_context) {
     
     /* Store the task's CPU context into the state structure */
     memcpy(&running_task->task_state, cpu_context, sizeof(registers_t));
+    if(prev_task->stats.switch_in_tsc != 0)
+        prev_task->stats.run_tsc += now - prev_task->stats.switch_in_tsc;
     /* We can safely invalidate running_task, because the code above 
        will never be run twice */
     running_task == NULL;
@@ -95,8 +171,12 @@ void switch_tasks(registers_t * cpu_context) {
         /* If we get inside this loop, no task is ready to run,
            so idle the processor until an interrupt comes 
            and readies a task */
+        idled = 1;
         enable();  // Enable interrupts
-        asm volatile("hlt"); // Halt the processor
+        /* Spend the idle time pre-zeroing frames, one per pass so a
+           task readied by an interrupt does not wait for the pool */
+        if(!pa_zero_pool_refill())
+            asm volatile("hlt"); // Halt the processor
 
         /* At this time, the processor is halted and k_reenter >= 0.
            Whenever an interrupt fires, k_reenter is incremented when
@@ -107,13 +187,37 @@ void switch_tasks(registers_t * cpu_context) {
            In other words, tasks that were put in the list will be
            dispatched in priority order */
     }
+    if(idled) {
+        now = sched_clock();
+        sched_idle_tsc += now - idle_start;
+    }
     /* There is a task to be run - unlink it from the list */
     remove((list_node_t *) next_task);
+    /* A task that is no longer ready gave up the CPU to wait */
+    if(next_task != prev_task) {
+        if(prev_task->flags & TS_READY)
+            prev_task->stats.invol_switches++;
+        else
+            prev_task->stats.vol_switches++;
+    }
+    next_task->stats.switch_in_tsc = now;
+    if(next_task->stats.ready_tsc != 0) {
+        account_wakeup(&next_task->stats, now - next_task->stats.ready_tsc);
+        next_task->stats.ready_tsc = 0;
+    }
     /* Set the running task to be the new task */
     running_task = next_task;
     running_task->flags |= TS_RUN;
+    trace_event(TRACE_SWITCH, (uint32_t) running_task);
+    /* Only reload CR3 when the address space really changes, so
+       switching between threads of one space keeps the TLB warm */
+    if(running_task->page_dir != act_page_directory)
+        switch_page_directory(running_task->page_dir);
     /* Restore the task's CPU context */
     memcpy(cpu_context, &running_task->task_state, sizeof(registers_t));
+    /* We are on the kernel stack and in another address space now */
+    if(prev_task->flags & TS_DEAD)
+        free_task(prev_task);
 }
 
 uint32_t wait(uint32_t sigs, list_head_t * wait_list)
@@ -140,6 +244,7 @@ uint32_t signal(task_t * task, uint32_t sigs)
         task->flags |= TS_READY;
         task->sigs_waiting &= ~sigs;
         task->sigs_recvd |= sigs;
+        task->stats.ready_tsc = sched_clock();
         remove((list_node_t *) task);
         enqueue(&tasks_ready, (list_node_t *) task);
         permit();
@@ -167,3 +272,77 @@ void delay(uint32_t ticks) {
     wait(TB_DELAY, &tasks_wait);
 }
 
+/* Run time including the slice the task is in right now */
+static uint64_t task_run_tsc(task_t * task, uint64_t now) {
+    uint64_t run = task->stats.run_tsc;
+
+    if(task == running_task && task->stats.switch_in_tsc != 0)
+        run += now - task->stats.switch_in_tsc;
+    return run;
+}
+
+void get_task_stats(task_t * task, task_stats_t * stats) {
+    forbid();
+    memcpy((uint8_t *) stats, (uint8_t *) &task->stats, sizeof(task_stats_t));
+    stats->run_tsc = task_run_tsc(task, sched_clock());
+    permit();
+}
+
+/* Move the run_mark_tsc of a task up to date, keeping the one that
+   ran the longest since its previous mark in *best */
+static void mark_task(task_t * task, task_t ** best, uint64_t * best_delta, uint64_t now) {
+    uint64_t run = task_run_tsc(task, now);
+
+    if(*best == NULL || run - task->stats.run_mark_tsc > *best_delta) {
+        *best_delta = run - task->stats.run_mark_tsc;
+        *best = task;
+    }
+    task->stats.run_mark_tsc = run;
+}
+
+void task_dump_names() {
+    list_node_t * node = get_head(&tasks_all);
+    task_t * task;
+    char line[64];
+
+    while(node != NULL) {
+        task = ALL_LINK_TASK(node);
+        sprintf(line, "TASK %08x %s\n", (uint32_t) task, task->ln_link.name);
+        serial_write(line);
+        node = get_next(node);
+    }
+}
+
+/* Share of period, which is in units of 1K cycles to stay in 32 bits */
+static uint32_t percent_of(uint64_t cycles, uint32_t period) {
+    uint32_t kcycles = (uint32_t) (cycles >> 10);
+
+    return kcycles >= period ? 100 : kcycles * 100 / period;
+}
+
+void sched_status(char * buf) {
+    static uint64_t last_tsc, last_idle;
+    uint64_t now, idle, best_delta = 0;
+    uint32_t period;
+    task_t * best = NULL;
+    list_node_t * node;
+
+    forbid();
+    now = sched_clock();
+    // Walk every task, those blocked on a semaphore, mutex or queue too
+    for(node = get_head(&tasks_all); node != NULL; node = get_next(node))
+        mark_task(ALL_LINK_TASK(node), &best, &best_delta, now);
+    idle = sched_idle_tsc - last_idle;
+    last_idle = sched_idle_tsc;
+    period = (uint32_t) ((now - last_tsc) >> 10);
+    if(last_tsc == 0 || period == 0) {
+        last_tsc = now;
+        permit();
+        strcpy(buf, "CPU  n/a");
+        return;
+    }
+    last_tsc = now;
+    sprintf(buf, "CPU %3d%% %-16.16s %3d%%", 100 - percent_of(idle, period),
+            best->ln_link.name, percent_of(best_delta, period));
+    permit();
+}
@@ -8,14 +8,37 @@
 #define TB_DELAY					1
 #define TB_QUEUE                    2
 #define TB_RESUME                   4
+#define TB_PORT                     8
+#define TB_SEMAPHORE                16
+#define TB_ABORT                    32  /* abort_io() on a request the driver holds */
 
 #define TS_RUN						1
 #define TS_READY					2
+#define TS_DEAD						4	/* Destroyed itself, freed once switched out */
 
 #define MAX_TASK_NAME_LENGTH		32
 
+/* Wakeup latency buckets: 0 is under 1 us, bucket n covers
+   [2^(n-1), 2^n) us and the last one everything slower */
+#define TASK_LAT_BUCKETS			16
+
 #include "common.h"
 #include "idt.h"
+#include "msgport.h"
+
+/* Scheduler accounting, all times in TSC cycles */
+struct task_stats_s {
+	uint64_t run_tsc;			/* Time spent running */
+	uint64_t switch_in_tsc;		/* When it last got the CPU */
+	uint64_t ready_tsc;			/* When signal() woke it, 0 if not pending */
+	uint64_t run_mark_tsc;		/* run_tsc at the last sched_status() */
+	uint32_t vol_switches;		/* Left the CPU to wait */
+	uint32_t invol_switches;	/* Left the CPU while still ready */
+	uint32_t wake_max_us;		/* Worst wakeup to run latency */
+	uint32_t wake_hist[TASK_LAT_BUCKETS];
+};
+
+typedef struct task_stats_s task_stats_t;
 
 struct task_s {
 	list_node_t ln_link;
@@ -27,10 +50,20 @@ struct task_s {
 	uint32_t task_delay;
 	void *(*atentry)(void *);
 	void *(*atexit)(void *);
+	msgport_t reply_port;
+	int32_t base_pri;
+	uint32_t mutexes_held;
+	struct mutex_s * blocked_on;
+	void * page_dir;			/* Physical address of the page directory */
+	list_head_t vm_regions;		/* Demand paged ranges, by address */
+	task_stats_t stats;
+	min_node_t all_link;		/* Link in tasks_all, wherever it waits */
 };
 
 typedef struct task_s task_t;
 
+/* NULL if there is no memory for the task, or stack_size does not fit
+   in the stack zone */
 task_t * create_task(void* (*code)(void*), char * task_name, uint32_t task_pri, uint32_t stack_size);
 
 void destroy_task(task_t * task);
@@ -53,4 +86,18 @@ uint32_t wait(uint32_t sigs, list_head_t * wait_list);
 
 void delay(uint32_t ticks);
 
+/* Copy the accounting of a task, including the running slice */
+void get_task_stats(task_t * task, task_stats_t * stats);
+
+/* TSC cycles the CPU spent idle in switch_tasks() */
+extern uint64_t sched_idle_tsc;
+
+/* Write a "top" style line to buf: CPU busy percentage and the
+   busiest task since the previous call */
+void sched_status(char * buf);
+
+/* Write a "TASK <pointer> <name>" line per task to the serial port,
+   for the trace and profile dumps */
+void task_dump_names();
+
 #endif
@@ -7,17 +7,28 @@
 #include "timer.h"
 #include "idt.h"
 #include "task.h"
+#include "cpu.h"
 
 extern uint32_t sched_state;
 extern list_head_t tasks_wait;
 extern wait_lock;
 
-uint32_t system_tick = 0;
+volatile uint32_t system_tick = 0;
+uint32_t timer_frequency;
+volatile uint64_t system_tick_tsc;
+volatile uint32_t tsc_per_tick;
 
 static void timer_callback (registers_t *regs)
 {
     task_t * tasks_waiting;
+    uint64_t tsc;
     system_tick++;
+    if (cpu_features_edx & CPU_FEAT_TSC) {
+        tsc = rdtsc();
+        if (system_tick_tsc != 0)
+            tsc_per_tick = (uint32_t) (tsc - system_tick_tsc);
+        system_tick_tsc = tsc;
+    }
     
     tasks_waiting = get_head(&tasks_wait);
     if (wait_lock == 0)
@@ -34,10 +45,16 @@ static void timer_callback (registers_t *regs)
     sched_state |= NEED_SCHEDULE;
 }
 
+uint32_t tsc_mhz()
+{
+  return tsc_per_tick / (1000000 / timer_frequency);
+}
+
 void init_timer (uint32_t frequency)
 {
   // Firstly, register our timer callback.
   register_interrupt_handler(IRQ0, &timer_callback);
+  timer_frequency = frequency;
 
   // The value we send to the PIT is the value to divide it's input clock
   // (1193180 Hz) by, to get our required frequency. Important to note is
@@ -9,4 +9,14 @@
 
 void init_timer (uint32_t frequency);
 
+extern volatile uint32_t system_tick;
+extern uint32_t timer_frequency;
+/* TSC value read on the last timer interrupt, 0 without a TSC */
+extern volatile uint64_t system_tick_tsc;
+/* TSC cycles between the last two timer interrupts */
+extern volatile uint32_t tsc_per_tick;
+
+/* TSC cycles per microsecond, 0 until two ticks have been seen */
+uint32_t tsc_mhz();
+
 #endif
@@ -0,0 +1,68 @@
+/* trace.c - Krypton kernel trace ring
+ *
+ * trace_dump() prints a text block on COM1 that trace2json.py
+ * turns into Chrome trace / Perfetto JSON:
+ *
+ *   TRACE begin cpus=<n> tsc_khz=<khz>
+ *   TASK <task pointer> <name>
+ *   E <cpu> <tsc, 16 hex digits> <type> <argument, hex>
+ *   TRACE end
+ */
+
+#include "trace.h"
+
+#ifdef CONFIG_TRACE
+
+#include "serial.h"
+#include "kprintf.h"
+#include "timer.h"
+#include "task.h"
+
+trace_ring_t trace_rings[TRACE_NR_CPUS];
+
+void trace_init() {
+    uint32_t cpu;
+
+    init_serial();
+    if (!(cpu_features_edx & CPU_FEAT_TSC))
+        return;
+    for (cpu = 0; cpu < TRACE_NR_CPUS; cpu++)
+        trace_rings[cpu].tr_active = 1;
+}
+
+void trace_dump() {
+    trace_ring_t * ring;
+    trace_rec_t * rec;
+    uint32_t cpu, i, first, count;
+    uint32_t was_active[TRACE_NR_CPUS];
+    char line[64];
+
+    /* Writers check tr_active, so freeze the rings first */
+    for (cpu = 0; cpu < TRACE_NR_CPUS; cpu++) {
+        was_active[cpu] = trace_rings[cpu].tr_active;
+        trace_rings[cpu].tr_active = 0;
+    }
+
+    sprintf(line, "TRACE begin cpus=%u tsc_khz=%u\n", TRACE_NR_CPUS,
+            (uint32_t) ((uint64_t) tsc_per_tick * timer_frequency / 1000));
+    serial_write(line);
+    task_dump_names();
+
+    for (cpu = 0; cpu < TRACE_NR_CPUS; cpu++) {
+        ring = &trace_rings[cpu];
+        count = (uint32_t) ring->tr_head;
+        first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+        for (i = first; i < count; i++) {
+            rec = &ring->tr_recs[i & (TRACE_RING_SIZE - 1)];
+            sprintf(line, "E %u %08x%08x %u %x\n", cpu, (uint32_t) (rec->tr_tsc >> 32),
+                    (uint32_t) rec->tr_tsc, rec->tr_type, rec->tr_arg);
+            serial_write(line);
+        }
+    }
+    serial_write("TRACE end\n");
+
+    for (cpu = 0; cpu < TRACE_NR_CPUS; cpu++)
+        trace_rings[cpu].tr_active = was_active[cpu];
+}
+
+#endif /* CONFIG_TRACE */
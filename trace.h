@@ -0,0 +1,81 @@
+/*
+ * File:   trace.h
+ *
+ *  Binary trace ring of TSC stamped kernel events, one per CPU. Built
+ *  only with CONFIG_TRACE (make TRACE=1); otherwise every tracepoint
+ *  compiles to nothing.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+/* Event types, the argument meaning is given for each */
+#define TRACE_SWITCH        1       /* Task switched in, task pointer */
+#define TRACE_IRQ_ENTRY     2       /* IRQ line */
+#define TRACE_IRQ_EXIT      3       /* IRQ line */
+#define TRACE_SYSCALL       4       /* System call number */
+#define TRACE_SYSCALL_EXIT  5       /* System call number */
+#define TRACE_QUEUE_SEND    6       /* Queue pointer */
+#define TRACE_QUEUE_RECV    7       /* Queue pointer */
+#define TRACE_PA_ALLOC      8       /* Physical address, 0 on failure */
+#define TRACE_KMALLOC       9       /* Requested size */
+
+#ifdef CONFIG_TRACE
+
+#include "atomic.h"
+#include "cpu.h"
+
+#define TRACE_RING_SIZE     4096    /* Records per CPU, a power of two */
+#define TRACE_NR_CPUS       1
+
+struct trace_rec_s {
+    uint64_t tr_tsc;
+    uint16_t tr_type;
+    uint16_t tr_cpu;
+    uint32_t tr_arg;
+};
+
+typedef struct trace_rec_s trace_rec_t;
+
+struct trace_ring_s {
+    volatile int32_t tr_head;           /* Records ever written */
+    volatile uint32_t tr_active;        /* Cleared while dumping */
+    trace_rec_t tr_recs[TRACE_RING_SIZE];
+};
+
+typedef struct trace_ring_s trace_ring_t;
+
+extern trace_ring_t trace_rings[TRACE_NR_CPUS];
+
+/* Slots are claimed with one locked add, so a tracepoint never waits
+   and can be hit from interrupts and tasks alike */
+static inline void trace_event(uint32_t type, uint32_t arg) {
+    trace_ring_t * ring = &trace_rings[0];
+    trace_rec_t * rec;
+
+    if (!ring->tr_active)
+        return;
+    rec = &ring->tr_recs[(uint32_t) (atomic_add(&ring->tr_head, 1) - 1) & (TRACE_RING_SIZE - 1)];
+    rec->tr_tsc = rdtsc();
+    rec->tr_type = type;
+    rec->tr_cpu = 0;
+    rec->tr_arg = arg;
+}
+
+/* Start tracing, if the CPU has a TSC */
+void trace_init();
+
+/* Write the rings to the serial port, oldest record first */
+void trace_dump();
+
+#else
+
+#define trace_event(type, arg)  do { } while (0)
+#define trace_init()            do { } while (0)
+#define trace_dump()            do { } while (0)
+
+#endif /* CONFIG_TRACE */
+
+#endif
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# trace2json.py - convert a Krypton serial trace dump to Chrome trace JSON
+#
+# Usage: trace2json.py serial.log > trace.json
+# Open the result in chrome://tracing or ui.perfetto.dev.
+
+import json
+import sys
+
+TRACE_SWITCH = 1
+TRACE_IRQ_ENTRY = 2
+TRACE_IRQ_EXIT = 3
+TRACE_SYSCALL = 4
+TRACE_SYSCALL_EXIT = 5
+TRACE_QUEUE_SEND = 6
+TRACE_QUEUE_RECV = 7
+TRACE_PA_ALLOC = 8
+TRACE_KMALLOC = 9
+
+INSTANTS = {
+    TRACE_QUEUE_SEND: ("queue_send", "queue"),
+    TRACE_QUEUE_RECV: ("queue_recv", "queue"),
+    TRACE_PA_ALLOC: ("pa_alloc", "paddr"),
+    TRACE_KMALLOC: ("kmalloc", "size"),
+}
+
+
+def parse(lines):
+    tsc_khz = 0
+    tasks = {}
+    records = []
+    inside = False
+    for line in lines:
+        line = line.strip()
+        if line.startswith("TRACE begin"):
+            inside = True
+            records = []
+            for field in line.split()[2:]:
+                key, _, value = field.partition("=")
+                if key == "tsc_khz":
+                    tsc_khz = int(value)
+        elif not inside:
+            continue
+        elif line == "TRACE end":
+            inside = False
+        elif line.startswith("TASK "):
+            _, ptr, name = (line.split(None, 2) + [""])[:3]
+            tasks[int(ptr, 16)] = name
+        elif line.startswith("E "):
+            _, cpu, tsc, type_, arg = line.split()
+            records.append((int(cpu), int(tsc, 16), int(type_), int(arg, 16)))
+    return tsc_khz, tasks, records
+
+
+# CPU tracks (pid 0) carry the running task slices and the nested IRQs.
+# System calls go on a track of their own per task (pid 1): a task can
+# be switched out in the middle of one, so they cannot nest inside its
+# running slice.
+def convert(tsc_khz, tasks, records):
+    if not records:
+        return []
+    scale = 1000.0 / tsc_khz if tsc_khz else 1.0
+    base = min(r[1] for r in records)
+    events = []
+    current = {}    # cpu -> (task pointer, slice start)
+    syscalls = {}   # cpu -> stack of task pointers with a call open
+    seen = set()
+
+    def ts(tsc):
+        return (tsc - base) * scale
+
+    def task_name(ptr):
+        return tasks.get(ptr, "task %08x" % ptr)
+
+    def end_slice(cpu, now):
+        ptr, start = current.pop(cpu)
+        events.append({"pid": 0, "tid": cpu, "ts": start, "dur": now - start,
+                       "ph": "X", "name": task_name(ptr), "cat": "task"})
+
+    for cpu, tsc, type_, arg in sorted(records, key=lambda r: r[1]):
+        now = ts(tsc)
+        ev = {"pid": 0, "tid": cpu, "ts": now}
+        if type_ == TRACE_SWITCH:
+            if cpu in current:
+                end_slice(cpu, now)
+            current[cpu] = (arg, now)
+        elif type_ in (TRACE_IRQ_ENTRY, TRACE_IRQ_EXIT):
+            ph = "B" if type_ == TRACE_IRQ_ENTRY else "E"
+            events.append(dict(ev, ph=ph, name="irq %d" % arg, cat="irq"))
+        elif type_ == TRACE_SYSCALL:
+            ptr = current.get(cpu, (0, 0))[0]
+            seen.add(ptr)
+            syscalls.setdefault(cpu, []).append(ptr)
+            events.append(dict(ev, pid=1, tid=ptr, ph="B",
+                               name="syscall %d" % arg, cat="syscall"))
+        elif type_ == TRACE_SYSCALL_EXIT:
+            # Belongs to the task that made the call, even when it has
+            # been switched out since
+            if syscalls.get(cpu):
+                events.append(dict(ev, pid=1, tid=syscalls[cpu].pop(), ph="E"))
+        elif type_ in INSTANTS:
+            name, key = INSTANTS[type_]
+            events.append(dict(ev, ph="i", s="t", name=name, cat="mem",
+                               args={key: "0x%x" % arg}))
+    last = ts(records[-1][1])
+    for cpu in list(current):
+        end_slice(cpu, last)
+    for stack in syscalls.values():
+        for ptr in stack:
+            events.append({"pid": 1, "tid": ptr, "ts": last, "ph": "E"})
+    events.append({"pid": 0, "ph": "M", "name": "process_name",
+                   "args": {"name": "cpus"}})
+    events.append({"pid": 1, "ph": "M", "name": "process_name",
+                   "args": {"name": "system calls"}})
+    for cpu in sorted(set(r[0] for r in records)):
+        events.append({"pid": 0, "tid": cpu, "ph": "M", "name": "thread_name",
+                       "args": {"name": "cpu %d" % cpu}})
+    for ptr in sorted(seen):
+        events.append({"pid": 1, "tid": ptr, "ph": "M", "name": "thread_name",
+                       "args": {"name": task_name(ptr)}})
+    return events
+
+
+def main():
+    src = open(sys.argv[1], errors="replace") if len(sys.argv) > 1 else sys.stdin
+    tsc_khz, tasks, records = parse(src)
+    json.dump({"traceEvents": convert(tsc_khz, tasks, records),
+               "displayTimeUnit": "ns"}, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -27,13 +27,16 @@ static int skip_atoi(const char **s)
 #define SPECIAL	32  /* 0x */
 #define SMALL	  64  /* use 'abcdef' instead of 'ABCDEF' */
 
+/* store c if it still fits, but keep counting past the end */
+#define PUT(c) do { if (str < end) *str = (c); ++str; } while (0)
+
 #define do_div(n,base) ({ \
 int __res; \
 __asm__("divl %4":"=a" (n),"=d" (__res):"0" (n),"1" (0),"r" (base)); \
 __res; })
 
-static char * number(char * str, int num, int base, int size, int precision
-	,int type)
+static char * number(char * str, char * end, int num, int base, int size,
+	int precision, int type)
 {
 	char c,sign,tmp[36];
 	const char *digits="0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
@@ -62,29 +65,33 @@ static char * number(char * str, int num, int base, int size, int precision
 	size -= precision;
 	if (!(type&(ZEROPAD+LEFT)))
 		while(size-->0)
-			*str++ = ' ';
+			PUT(' ');
 	if (sign)
-		*str++ = sign;
+		PUT(sign);
 	if (type&SPECIAL)
 		if (base==8)
-			*str++ = '0';
+			PUT('0');
 		else if (base==16) {
-			*str++ = '0';
-			*str++ = digits[33];
+			PUT('0');
+			PUT(digits[33]);
 		}
 	if (!(type&LEFT))
 		while(size-->0)
-			*str++ = c;
+			PUT(c);
 	while(i<precision--)
-		*str++ = '0';
+		PUT('0');
 	while(i-->0)
-		*str++ = tmp[i];
+		PUT(tmp[i]);
 	while(size-->0)
-		*str++ = ' ';
+		PUT(' ');
 	return str;
 }
 
-int vsprintf(char *buf, const char *fmt, va_list args)
+/*
+ * vsnprintf() writes at most size bytes including the '\0', and returns
+ * the length the whole output would have had.
+ */
+int vsnprintf(char *buf, unsigned int size, const char *fmt, va_list args)
 {
 	int len;
 	int i;
@@ -99,9 +106,17 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 				   number of chars for from string */
 	int qualifier;		/* 'h', 'l', or 'L' for integer fields */
 
+	char *end;
+
+	/* size may run past the address space, as vsprintf() asks */
+	if ((unsigned long) buf + size < (unsigned long) buf)
+		end = (char *) -1;
+	else
+		end = buf + size;
+
 	for (str=buf ; *fmt ; ++fmt) {
 		if (*fmt != '%') {
-			*str++ = *fmt;
+			PUT(*fmt);
 			continue;
 		}
 			
@@ -155,10 +170,10 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 		case 'c':
 			if (!(flags & LEFT))
 				while (--field_width > 0)
-					*str++ = ' ';
-			*str++ = (unsigned char) va_arg(args, int);
+					PUT(' ');
+			PUT((unsigned char) va_arg(args, int));
 			while (--field_width > 0)
-				*str++ = ' ';
+				PUT(' ');
 			break;
 
 		case 's':
@@ -171,15 +186,15 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 
 			if (!(flags & LEFT))
 				while (len < field_width--)
-					*str++ = ' ';
+					PUT(' ');
 			for (i = 0; i < len; ++i)
-				*str++ = *s++;
+				PUT(*s++);
 			while (len < field_width--)
-				*str++ = ' ';
+				PUT(' ');
 			break;
 
 		case 'o':
-			str = number(str, va_arg(args, unsigned long), 8,
+			str = number(str, end, va_arg(args, unsigned long), 8,
 				field_width, precision, flags);
 			break;
 
@@ -188,7 +203,7 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 				field_width = 8;
 				flags |= ZEROPAD;
 			}
-			str = number(str,
+			str = number(str, end,
 				(unsigned long) va_arg(args, void *), 16,
 				field_width, precision, flags);
 			break;
@@ -196,7 +211,7 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 		case 'x':
 			flags |= SMALL;
 		case 'X':
-			str = number(str, va_arg(args, unsigned long), 16,
+			str = number(str, end, va_arg(args, unsigned long), 16,
 				field_width, precision, flags);
 			break;
 
@@ -204,11 +219,11 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 		case 'i':
 			flags |= SIGN;
 		case 'u':
-			str = number(str, va_arg(args, unsigned long), 10,
+			str = number(str, end, va_arg(args, unsigned long), 10,
 				field_width, precision, flags);
 			break;
 		case 'b':
-			str = number(str, va_arg(args, unsigned long), 2,
+			str = number(str, end, va_arg(args, unsigned long), 2,
 				field_width, precision, flags);
 			break;
 
@@ -219,15 +234,21 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 
 		default:
 			if (*fmt != '%')
-				*str++ = '%';
+				PUT('%');
 			if (*fmt)
-				*str++ = *fmt;
+				PUT(*fmt);
 			else
 				--fmt;
 			break;
 		}
 	}
-	*str = '\0';
+	if (size > 0)
+		*(str < end ? str : end - 1) = '\0';
 	return str-buf;
 }
 
+int vsprintf(char *buf, const char *fmt, va_list args)
+{
+	return vsnprintf(buf, ~0U, fmt, args);
+}
+
@@ -6,4 +6,6 @@
 
 int vsprintf(char *buf, const char *fmt, va_list args);
 
+int vsnprintf(char *buf, unsigned int size, const char *fmt, va_list args);
+
 #endif /* _VSPRINTF_H */